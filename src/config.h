@@ -19,6 +19,20 @@ static struct config_t config = {
     .blink_delay={ .tv_sec  = 0,
                    .tv_usec = 600000 },
 
+    /* Time the window size must stay the same before the shell is told
+     * about it. Saves the shell redrawing for every step of a resize */
+    .resize_delay={ .tv_sec  = 0,
+                    .tv_usec = 100000 },
+
+    /* Bytes of rows kept drawn, to be copied when they are shown again.
+     * 0 turns the cache off */
+    .row_cache_size = 8 << 20,
+
+    /* Draw everything ourselves into an image shared with the X server,
+     * and send it only the parts that changed. For local displays that
+     * have the MIT-SHM extension */
+    .xshm       = false,
+
     /* Background Color Erase: if true, cells are erased with the current
      * background color, else they are erased with the default background
      * color (config.background).
@@ -249,6 +249,12 @@ esc_state_escape(char c)
 
 /* Public API */
 
+bool
+esc_idle()
+{
+    return esc_seq.state == NULL;
+}
+
 void
 esc_init(esc_dispatch_t esc, csi_dispatch_t csi, osc_dispatch_t osc)
 {
@@ -12,6 +12,9 @@ typedef void (*osc_dispatch_t)(char *arg, size_t lenght);
 
 /* Return true if c was handled, false if not (e.g. c should print) */
 bool esc_handle(char c); 
+/* Return true if no sequence is being parsed, so c would be printed or
+ * executed as is */
+bool esc_idle();
 void esc_init(esc_dispatch_t, csi_dispatch_t, osc_dispatch_t);
 
 /* http://invisible-island.net/xterm/ctlseqs/ctlseqs.html
@@ -0,0 +1,417 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+#include "kernels.h"
+#include "util.h"
+
+/* Scalar {{{ */
+
+static void
+fill_text_scalar(wchar_t *text, wchar_t c, size_t n)
+{
+    size_t i;
+
+    if (c == '\0') {
+        memset(text, 0, n * sizeof(*text));
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        text[i] = c;
+    }
+}
+
+static void
+fill_style_scalar(uint16_t *style, uint16_t id, size_t n)
+/* Doubling the filled part with memcpy */
+{
+    size_t done;
+
+    if (id == 0) {
+        memset(style, 0, n * sizeof(*style));
+        return;
+    }
+    if (n == 0) {
+        return;
+    }
+    style[0] = id;
+    for (done = 1; done < n; done *= 2) {
+        memcpy(style + done, style, min(done, n - done) * sizeof(*style));
+    }
+}
+
+static size_t
+style_run_scalar(const uint16_t *style, size_t n)
+{
+    size_t i = 1;
+
+    while (i < n && style[i] == style[0]) {
+        i++;
+    }
+    return i;
+}
+
+static uint64_t
+cells_differ_scalar(const wchar_t *text, const uint16_t *style,
+                    const wchar_t *shown_text, const uint16_t *shown_style, size_t n)
+{
+    uint64_t diff = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        diff |= (uint64_t)(text[i] != shown_text[i] || style[i] != shown_style[i]) << i;
+    }
+    return diff;
+}
+
+static void
+fill_pixels_scalar(uint32_t *pixels, uint32_t color, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        pixels[i] = color;
+    }
+}
+
+static void
+mask_pixels_scalar(uint32_t *pixels, const uint8_t *mask, uint32_t color, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (mask[i]) {
+            pixels[i] = color;
+        }
+    }
+}
+
+/* }}} */
+
+#ifdef KERNELS_X86
+
+/* SSE2 {{{ */
+
+__attribute__((target("sse2")))
+static void
+fill_text_sse2(wchar_t *text, wchar_t c, size_t n)
+{
+    __m128i v = _mm_set1_epi32(c);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(text + i), v);
+    }
+    for (; i < n; i++) {
+        text[i] = c;
+    }
+}
+
+__attribute__((target("sse2")))
+static void
+fill_style_sse2(uint16_t *style, uint16_t id, size_t n)
+{
+    __m128i v = _mm_set1_epi16(id);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(style + i), v);
+    }
+    for (; i < n; i++) {
+        style[i] = id;
+    }
+}
+
+__attribute__((target("sse2")))
+static size_t
+style_run_sse2(const uint16_t *style, size_t n)
+{
+    __m128i first = _mm_set1_epi16(style[0]);
+    size_t i = 1;
+    int mask;
+
+    for (; i + 8 <= n; i += 8) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi16(
+                    _mm_loadu_si128((const __m128i *)(style + i)), first));
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask) / 2;
+        }
+    }
+    while (i < n && style[i] == style[0]) {
+        i++;
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+cells_differ_sse2(const wchar_t *text, const uint16_t *style,
+                  const wchar_t *shown_text, const uint16_t *shown_style, size_t n)
+/* Eight cells at a time: two compares of text and one of style, packed
+ * down to a byte per cell */
+{
+    uint64_t diff = 0;
+    size_t i = 0;
+    __m128i eq;
+
+    for (; i + 8 <= n; i += 8) {
+        eq = _mm_packs_epi32(
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(text + i)),
+                                _mm_loadu_si128((const __m128i *)(shown_text + i))),
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(text + i + 4)),
+                                _mm_loadu_si128((const __m128i *)(shown_text + i + 4))));
+        eq = _mm_and_si128(eq,
+                _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(style + i)),
+                                _mm_loadu_si128((const __m128i *)(shown_style + i))));
+        diff |= (uint64_t)(~_mm_movemask_epi8(_mm_packs_epi16(eq, eq)) & 0xff) << i;
+    }
+    for (; i < n; i++) {
+        diff |= (uint64_t)(text[i] != shown_text[i] || style[i] != shown_style[i]) << i;
+    }
+    return diff;
+}
+
+__attribute__((target("sse2")))
+static void
+fill_pixels_sse2(uint32_t *pixels, uint32_t color, size_t n)
+{
+    __m128i v = _mm_set1_epi32(color);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(pixels + i), v);
+    }
+    for (; i < n; i++) {
+        pixels[i] = color;
+    }
+}
+
+__attribute__((target("sse2")))
+static void
+mask_pixels_sse2(uint32_t *pixels, const uint8_t *mask, uint32_t color, size_t n)
+/* Four pixels at a time, the mask bytes widened to a word per pixel */
+{
+    __m128i v = _mm_set1_epi32(color), zero = _mm_setzero_si128();
+    __m128i m, old;
+    uint32_t bytes;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        memcpy(&bytes, mask + i, sizeof(bytes));
+        if (bytes == 0) {
+            continue;
+        }
+        m = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+        m = _mm_cmpeq_epi32(m, zero); /* Set where the pixel is kept */
+        old = _mm_loadu_si128((const __m128i *)(pixels + i));
+        _mm_storeu_si128((__m128i *)(pixels + i),
+                         _mm_or_si128(_mm_and_si128(m, old), _mm_andnot_si128(m, v)));
+    }
+    for (; i < n; i++) {
+        if (mask[i]) {
+            pixels[i] = color;
+        }
+    }
+}
+
+/* }}} */
+
+/* AVX2 {{{ */
+
+__attribute__((target("avx2")))
+static void
+fill_text_avx2(wchar_t *text, wchar_t c, size_t n)
+{
+    __m256i v = _mm256_set1_epi32(c);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)(text + i), v);
+    }
+    for (; i < n; i++) {
+        text[i] = c;
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+fill_style_avx2(uint16_t *style, uint16_t id, size_t n)
+{
+    __m256i v = _mm256_set1_epi16(id);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i *)(style + i), v);
+    }
+    for (; i < n; i++) {
+        style[i] = id;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t
+style_run_avx2(const uint16_t *style, size_t n)
+{
+    __m256i first = _mm256_set1_epi16(style[0]);
+    size_t i = 1;
+    uint32_t mask;
+
+    for (; i + 16 <= n; i += 16) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+                    _mm256_loadu_si256((const __m256i *)(style + i)), first));
+        if (mask != 0xffffffff) {
+            return i + __builtin_ctz(~mask) / 2;
+        }
+    }
+    while (i < n && style[i] == style[0]) {
+        i++;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+cells_differ_avx2(const wchar_t *text, const uint16_t *style,
+                  const wchar_t *shown_text, const uint16_t *shown_style, size_t n)
+/* Sixteen cells at a time. Text compares give a bit per cell through
+ * movemask_ps, and style compares are packed down to a byte per cell */
+{
+    uint64_t diff = 0;
+    size_t i = 0;
+    uint32_t same;
+    __m256i eq;
+
+    for (; i + 16 <= n; i += 16) {
+        same = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(
+                    _mm256_loadu_si256((const __m256i *)(text + i)),
+                    _mm256_loadu_si256((const __m256i *)(shown_text + i)))));
+        same |= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(
+                    _mm256_loadu_si256((const __m256i *)(text + i + 8)),
+                    _mm256_loadu_si256((const __m256i *)(shown_text + i + 8))))) << 8;
+        eq = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(style + i)),
+                                _mm256_loadu_si256((const __m256i *)(shown_style + i)));
+        same &= _mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(eq),
+                                                  _mm256_extracti128_si256(eq, 1)));
+        diff |= (uint64_t)(~same & 0xffff) << i;
+    }
+    for (; i < n; i++) {
+        diff |= (uint64_t)(text[i] != shown_text[i] || style[i] != shown_style[i]) << i;
+    }
+    return diff;
+}
+
+__attribute__((target("avx2")))
+static void
+fill_pixels_avx2(uint32_t *pixels, uint32_t color, size_t n)
+{
+    __m256i v = _mm256_set1_epi32(color);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)(pixels + i), v);
+    }
+    for (; i < n; i++) {
+        pixels[i] = color;
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+mask_pixels_avx2(uint32_t *pixels, const uint8_t *mask, uint32_t color, size_t n)
+/* Eight pixels at a time, the mask bytes widened to a word per pixel */
+{
+    __m256i v = _mm256_set1_epi32(color), zero = _mm256_setzero_si256();
+    __m256i m;
+    uint64_t bytes;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&bytes, mask + i, sizeof(bytes));
+        if (bytes == 0) {
+            continue;
+        }
+        m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(mask + i)));
+        m = _mm256_cmpeq_epi32(m, zero); /* Set where the pixel is kept */
+        _mm256_storeu_si256((__m256i *)(pixels + i),
+                _mm256_blendv_epi8(v, _mm256_loadu_si256((const __m256i *)(pixels + i)), m));
+    }
+    for (; i < n; i++) {
+        if (mask[i]) {
+            pixels[i] = color;
+        }
+    }
+}
+
+/* }}} */
+
+#endif /* KERNELS_X86 */
+
+static const struct kernels_t variants[] = { /* Best first */
+#ifdef KERNELS_X86
+    { "avx2",   fill_text_avx2,   fill_style_avx2,   style_run_avx2,   cells_differ_avx2,
+                fill_pixels_avx2,   mask_pixels_avx2 },
+    { "sse2",   fill_text_sse2,   fill_style_sse2,   style_run_sse2,   cells_differ_sse2,
+                fill_pixels_sse2,   mask_pixels_sse2 },
+#endif
+    { "scalar", fill_text_scalar, fill_style_scalar, style_run_scalar, cells_differ_scalar,
+                fill_pixels_scalar, mask_pixels_scalar },
+};
+
+struct kernels_t kernels = {
+    "scalar", fill_text_scalar, fill_style_scalar, style_run_scalar, cells_differ_scalar,
+              fill_pixels_scalar, mask_pixels_scalar
+};
+
+static bool
+kernels_supported(const char *name)
+{
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+void
+kernels_init()
+/* Use the best kernels the CPU runs */
+{
+    size_t i;
+
+    for (i = 0; i < LENGTH(variants); i++) {
+        if (kernels_select(variants[i].name)) {
+            break;
+        }
+    }
+    debug("%s", kernels.name);
+}
+
+bool /* Return false if the CPU doesn't run them */
+kernels_select(const char *name)
+/* Use the kernels called name, for tests and benchmarks */
+{
+    size_t i;
+
+    for (i = 0; i < LENGTH(variants); i++) {
+        if (strcmp(variants[i].name, name) == 0 && kernels_supported(name)) {
+            kernels = variants[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * /* Return NULL past the last */
+kernels_list(size_t i)
+/* Name the i'th kernels built in, best first */
+{
+    return i < LENGTH(variants) ? variants[i].name : NULL;
+}
@@ -0,0 +1,40 @@
+/* Loops over the cells of a row, in the widest vector instructions the CPU
+ * has. Text is a wchar_t per cell and style a 16 bit id per cell, as in the
+ * grid of terminal.c. Pixels are 32 bit, as in the shared image of terma.c */
+
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+struct kernels_t {
+    const char *name;
+    /* Set n cells to c */
+    void      (*fill_text)(wchar_t *text, wchar_t c, size_t n);
+    void      (*fill_style)(uint16_t *style, uint16_t id, size_t n);
+    /* Return how many cells from the start of style, at least one, have
+     * the first one's style */
+    size_t    (*style_run)(const uint16_t *style, size_t n);
+    /* Return a bit for each of the first n (up to 64) cells whose text or
+     * style differs from shown */
+    uint64_t  (*cells_differ)(const wchar_t *text, const uint16_t *style,
+                              const wchar_t *shown_text,
+                              const uint16_t *shown_style, size_t n);
+    /* Set n pixels to color */
+    void      (*fill_pixels)(uint32_t *pixels, uint32_t color, size_t n);
+    /* Set each of n pixels whose mask byte isn't zero to color */
+    void      (*mask_pixels)(uint32_t *pixels, const uint8_t *mask,
+                             uint32_t color, size_t n);
+};
+
+/* The kernels in use. Scalar until kernels_init */
+extern struct kernels_t kernels;
+
+void kernels_init();
+bool kernels_select(const char *name);
+const char *kernels_list(size_t i);
+
+#endif
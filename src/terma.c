@@ -9,24 +9,36 @@
 #include <stropts.h>
 #include <string.h>
 #include <unistd.h>
+#include <wchar.h>
 #include <sys/ioctl.h>
+#include <sys/ipc.h>
 #include <sys/select.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 
 #include <linux/kd.h> /* Writing LED */
 
 #include "util.h"
 
+#include "kernels.h"
 #include "shell.h"
 #include "terminal.h"
+#include "wcwidth.h"
 
 #include "config.h"
 
 const char *WINDOW_TITLE  = TERM_NAME;
 static int shell_fd;
 
+struct row_cache_stats_t {
+    unsigned long     hits, misses;
+    size_t            slots;
+};
+
 
 void init();
 void run();
@@ -36,12 +48,25 @@ void run();
 void x_clearline(size_t col, size_t row, size_t length, color_t bg);
 void x_destroy();
 void x_draw();
+void x_drawcluster(size_t col, size_t row, wchar_t *text, size_t length, color_t fg, color_t bg, bool bold, bool underline);
 void x_drawline(size_t col, size_t row, wchar_t *text, size_t length, color_t fg, color_t bg, bool bold, bool underline);
+void x_drawlist(const struct draw_frame_t *frame);
+void x_drawrun(const struct draw_run_t *run);
 void x_init();
 void x_init_gc();
+void x_init_shm();
 void x_init_input();
 void x_init_window();
 void x_resize(size_t width, size_t height);
+void x_row_cache_reset(size_t cols, size_t rows);
+bool x_row_cache_get(uint64_t key, size_t row);
+void x_row_cache_put(uint64_t key, size_t row);
+struct row_cache_stats_t x_row_cache_stats();
+void x_scroll(size_t top, size_t bottom, int lines);
+bool x_shm_create(size_t width, size_t height);
+void x_shm_fallback();
+void x_shm_damage_reset(size_t cols, size_t rows);
+void x_shm_drawlist(const struct draw_frame_t *frame);
 void x_show();
 
 /* X event callbacks */
@@ -49,6 +74,7 @@ void x_on_configure(XEvent *event);
 void x_on_expose(XEvent *event);
 void x_on_keypress(XEvent *event);
 void on_reschange(size_t cols, size_t rows);
+void report_winsize(struct timeval now);
 
 static void (*x_handler[])(XEvent *) = {
     [KeyPress]         = x_on_keypress,
@@ -58,9 +84,8 @@ static void (*x_handler[])(XEvent *) = {
 
 static struct term_push_callbacks callbacks = {
     .write_host         = sh_write,
-    .write_screen       = x_drawline,
-    .write_finished     = x_show,
-    .clear_line         = x_clearline,
+    .draw_list          = x_drawlist,
+    .scroll             = x_scroll,
     .res_change         = on_reschange,
 };
 
@@ -70,6 +95,44 @@ static struct {
     Window            window;
     GC                gc;
     Pixmap            pixmap;
+    size_t            pixmap_width;  /* Allocated size of the pixmap or the */
+    size_t            pixmap_height; /* shared image, may be larger than the
+                                        window */
+    Pixmap            scratch; /* Glyphs are drawn here, see x_glyph_bits */
+    GC                scratch_gc;
+
+    wchar_t          *text; /* Text being drawn, see x_drawline */
+    size_t            text_size;
+    XRectangle       *rects; /* Fills being drawn, see x_drawlist */
+    size_t            rects_size;
+
+    struct {
+        bool          enabled; /* See x_init_shm */
+        XShmSegmentInfo info;
+        XImage       *image;  /* Drawn to in place of the pixmap */
+        bool          busy;   /* The server may still be reading image */
+        uint8_t      *atlas;  /* Glyphs, a byte per pixel, two cells wide */
+        size_t        atlas_slots;
+        size_t        atlas_size;
+        uint32_t     *slot[2][0x1100]; /* Atlas slot + 1 per character, regular
+                                          and bold, in pages of 256 */
+        size_t       *damage_from; /* Cells to send, per row */
+        size_t       *damage_to;
+        size_t        cols, rows;
+        bool          damage_all; /* All of the window, border included */
+    }                 shm;
+
+    struct {
+        Pixmap        pixmap; /* A row in each slot, one below the other */
+        uint64_t     *key;    /* Per slot, see draw_row_t */
+        uint64_t     *used;   /* Frame the slot was last used in, 0 if empty */
+        size_t        slots;
+        size_t        width;
+        uint64_t      frame;
+        unsigned long hits, misses;
+        bool         *hit;    /* Per row of the screen, in this frame */
+        size_t        rows;
+    }                 row_cache;
 
     size_t            glyph_ascent;
     size_t            glyph_descent;
@@ -85,8 +148,21 @@ static struct {
     XIC               xic;
 
     struct timeval    last_draw;
+
+    struct {
+        bool          pending;  /* Acted on once per frame */
+        size_t        width, height;
+    }                 configure;
+    struct {
+        bool          pending;  /* Not yet reported to the shell */
+        size_t        cols, rows;
+        struct timeval changed;
+    }                 winsize;
 } X;
 
+/* The pixmap grows in steps of this many pixels */
+#define PIXMAP_STEP 256
+
 
 
 void
@@ -133,13 +209,45 @@ x_init_font()
 void
 x_init_gc()
 {
-    uint32_t mask   = GCForeground | GCBackground;
+    uint32_t mask   = GCForeground | GCBackground | GCGraphicsExposures;
 
     XGCValues values;
     values.foreground   = config.foreground;
     values.background   = config.background;
+    /* Copies are from the pixmap, which is never obscured. Left on, each
+     * one would queue a NoExpose event, which wakes run() from passive */
+    values.graphics_exposures = False;
 
     X.gc = XCreateGC(X.dpy, X.window, mask, &values);
+
+    X.scratch = XCreatePixmap(X.dpy,
+                              X.window,
+                              2 * X.glyph_width, X.glyph_height,
+                              1);
+    X.scratch_gc = XCreateGC(X.dpy, X.scratch, 0, NULL);
+}
+
+void
+x_init_shm()
+/* Draw on our side if asked to, the server shares memory with us, and its
+ * pixels are the colors of config as they are. Servers on other machines
+ * may have the extension too, so an image is tried out */
+{
+    Visual *visual = XDefaultVisual(X.dpy, X.screen);
+
+    if (!config.xshm || !XShmQueryExtension(X.dpy) ||
+        XDefaultDepth(X.dpy, X.screen) < 24 ||
+        visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 || visual->blue_mask != 0xff) {
+        return;
+    }
+    if (!x_shm_create(1, 1)) {
+        warning("No shared image, drawing on the server");
+        return;
+    }
+    x_shm_create(0, 0);
+    debug("Shared image");
+    X.shm.enabled = true;
+    callbacks.draw_list = x_shm_drawlist;
 }
 
 
@@ -191,7 +299,10 @@ x_init()
     x_init_font();
     x_init_window();
     x_init_gc();
+    x_init_shm();
     x_init_input();
+    /* Rows are only keyed for the row cache */
+    callbacks.row_keys = !X.shm.enabled && config.row_cache_size > 0;
     /* We don't initialize the pixmap; we'll get a resize soon enough */
 
     XMapWindow(X.dpy, X.window);
@@ -201,14 +312,66 @@ x_init()
 void
 x_destroy()
 {
+    size_t i;
+
     debug(".");
     XFreeFontSet(X.dpy, X.font);
     XFreeFontSet(X.dpy, X.bold_font);
     XDestroyIC(X.xic);
     XCloseIM(X.xim);
-    XFreePixmap(X.dpy, X.pixmap);
+    if (X.shm.atlas_size > 0) {
+        debug("atlas: %lu glyphs", (unsigned long)X.shm.atlas_slots);
+    }
+    x_shm_create(0, 0);
+    for (i = 0; i < LENGTH(X.shm.slot[0]); i++) {
+        free(X.shm.slot[0][i]);
+        free(X.shm.slot[1][i]);
+    }
+    free(X.shm.atlas);
+    free(X.shm.damage_from);
+    free(X.shm.damage_to);
+    if (X.pixmap) {
+        XFreePixmap(X.dpy, X.pixmap);
+    }
+    XFreeGC(X.dpy, X.scratch_gc);
+    XFreePixmap(X.dpy, X.scratch);
+    if (X.row_cache.pixmap) {
+        XFreePixmap(X.dpy, X.row_cache.pixmap);
+    }
     XFreeGC(X.dpy, X.gc);
     XCloseDisplay(X.dpy);
+    debug("row cache: %lu hits, %lu misses",
+          x_row_cache_stats().hits, x_row_cache_stats().misses);
+    free(X.row_cache.key);
+    free(X.row_cache.used);
+    free(X.row_cache.hit);
+    free(X.text);
+    free(X.rects);
+}
+
+static void
+x_fill(size_t x, size_t y, size_t width, size_t height, color_t color)
+/* Fill a rectangle of what frames are drawn to, the pixmap or the shared
+ * image */
+{
+    size_t i;
+
+    if (!X.shm.enabled) {
+        XSetForeground(X.dpy, X.gc, color);
+        XFillRectangle(X.dpy, X.pixmap, X.gc, x, y, width, height);
+        return;
+    }
+    if (X.shm.image == NULL) {
+        return;
+    }
+    if (X.shm.busy) {
+        XSync(X.dpy, False);
+        X.shm.busy = false;
+    }
+    for (i = y; i < y + height; i++) {
+        kernels.fill_pixels((uint32_t *)(X.shm.image->data + i * X.shm.image->bytes_per_line) + x,
+                            color, width);
+    }
 }
 
 void
@@ -220,21 +383,32 @@ x_resize(size_t width, size_t height)
 
     debug("%lux%lu", (long unsigned)width, (long unsigned)height);
 
-    /* Update pixmap */
-    if (X.pixmap)
-        XFreePixmap(X.dpy, X.pixmap);
-    X.pixmap = XCreatePixmap(X.dpy,
-                             X.window,
-                             width, height,
-                             XDefaultDepth(X.dpy, X.screen));
-    XSetForeground(X.dpy,
-                   X.gc,
-                   config.background);
-    XFillRectangle(X.dpy,
-                   X.pixmap,
-                   X.gc,
-                   0, 0,
-                   width, height);
+    if (width > X.pixmap_width || height > X.pixmap_height) {
+        /* Update pixmap */
+        X.pixmap_width  = (max(width,  X.pixmap_width)  + PIXMAP_STEP - 1) / PIXMAP_STEP * PIXMAP_STEP;
+        X.pixmap_height = (max(height, X.pixmap_height) + PIXMAP_STEP - 1) / PIXMAP_STEP * PIXMAP_STEP;
+        if (X.shm.enabled && !x_shm_create(X.pixmap_width, X.pixmap_height)) {
+            x_shm_fallback();
+        }
+        if (!X.shm.enabled) {
+            if (X.pixmap)
+                XFreePixmap(X.dpy, X.pixmap);
+            X.pixmap = XCreatePixmap(X.dpy,
+                                     X.window,
+                                     X.pixmap_width, X.pixmap_height,
+                                     XDefaultDepth(X.dpy, X.screen));
+        }
+        x_fill(0, 0, X.pixmap_width, X.pixmap_height, config.background);
+    }
+    else {
+        /* Parts uncovered may hold what was painted at an earlier size */
+        if (width > X.win_width) {
+            x_fill(X.win_width, 0, width - X.win_width, height, config.background);
+        }
+        if (height > X.win_height) {
+            x_fill(0, X.win_height, width, height - X.win_height, config.background);
+        }
+    }
 
     X.win_width  = width;
     X.win_height = height;
@@ -259,6 +433,19 @@ x_drawline(size_t col, size_t row, wchar_t *text, size_t length, color_t fg, col
     size_t xpix  = col    * X.glyph_width;
     size_t width = length * X.glyph_width;
     size_t ypix  = row * X.glyph_height + X.glyph_ascent;
+    size_t i;
+
+    /* Blank cells come as '\0', which the font may not have */
+    if (wmemchr(text, L'\0', length) != NULL) {
+        if (length > X.text_size) {
+            X.text_size = length;
+            X.text = erealloc(X.text, X.text_size * sizeof(*X.text));
+        }
+        for (i = 0; i < length; i++) {
+            X.text[i] = (text[i] == L'\0') ? L' ' : text[i];
+        }
+        text = X.text;
+    }
 
     XwcDrawImageString(X.dpy,
                        X.pixmap,
@@ -279,6 +466,42 @@ x_drawline(size_t col, size_t row, wchar_t *text, size_t length, color_t fg, col
     }
 }
 
+void
+x_drawcluster(size_t col, size_t row, wchar_t *text, size_t length, color_t fg, color_t bg, bool bold, bool underline)
+{
+    /* Base character with background, then the combining characters on
+     * top of it in the same cell */
+    x_drawline(col, row, text, 1, fg, bg, bold, underline);
+
+    XwcDrawString(X.dpy,
+                  X.pixmap,
+                  bold ? X.bold_font : X.font,
+                  X.gc,
+                  col * X.glyph_width,
+                  row * X.glyph_height + X.glyph_ascent,
+                  text + 1,
+                  length - 1);
+}
+
+void
+x_drawrun(const struct draw_run_t *run)
+{
+    if (run->text == NULL || run->wide) {
+        x_clearline(run->col, run->row, run->cells, run->bg);
+    }
+    if (run->text == NULL) {
+        return;
+    }
+    if (run->cluster) {
+        x_drawcluster(run->col, run->row, run->text, run->length,
+                      run->fg, run->bg, run->bold, run->underline);
+    }
+    else {
+        x_drawline(run->col, run->row, run->text, run->length,
+                   run->fg, run->bg, run->bold, run->underline);
+    }
+}
+
 void
 x_clearline(size_t col, size_t row, size_t length, color_t bg)
 {
@@ -294,6 +517,510 @@ x_clearline(size_t col, size_t row, size_t length, color_t bg)
                    X.glyph_height);
 }
 
+static void
+x_glyph_bits(bool bold, wchar_t c, size_t width, uint8_t *bits, size_t stride)
+/* Draw the glyph of c with the core font, width pixels wide, and read it
+ * back into bits: a byte per pixel, 0xff where it is set */
+{
+    XImage *image;
+    size_t x, y;
+
+    XSetForeground(X.dpy, X.scratch_gc, 0);
+    XFillRectangle(X.dpy, X.scratch, X.scratch_gc, 0, 0, width, X.glyph_height);
+    XSetForeground(X.dpy, X.scratch_gc, 1);
+    XwcDrawString(X.dpy,
+                  X.scratch,
+                  bold ? X.bold_font : X.font,
+                  X.scratch_gc,
+                  0, X.glyph_ascent,
+                  &c, 1);
+    image = XGetImage(X.dpy, X.scratch, 0, 0, width, X.glyph_height, 1, ZPixmap);
+
+    memset(bits, 0, stride * X.glyph_height);
+    for (y = 0; y < X.glyph_height; y++) {
+        for (x = 0; x < width; x++) {
+            if (XGetPixel(image, x, y)) {
+                bits[y * stride + x] = 0xff;
+            }
+        }
+    }
+    XDestroyImage(image);
+}
+
+void
+x_drawlist(const struct draw_frame_t *frame)
+/* Draw a frame. Rows drawn before are copied from the row cache, and the
+ * runs in them skipped. Fills come grouped by color, and each group goes
+ * out in one request */
+{
+    const struct draw_run_t *run = frame->run, *end = run + frame->runs;
+    bool *hit = X.row_cache.hit;
+    size_t i, n;
+
+    if (frame->scroll.lines != 0) {
+        x_scroll(frame->scroll.top, frame->scroll.bottom, frame->scroll.lines);
+    }
+
+    X.row_cache.frame++;
+    for (i = 0; i < frame->rows; i++) {
+        hit[frame->row[i].row] = x_row_cache_get(frame->row[i].key, frame->row[i].row);
+    }
+
+    while (run < end && run->text == NULL) {
+        color_t bg = run->bg;
+
+        for (n = 0; run < end && run->text == NULL && run->bg == bg; run++) {
+            if (hit[run->row]) {
+                continue;
+            }
+            if (n == X.rects_size) {
+                X.rects_size = max(64, X.rects_size * 2);
+                X.rects = erealloc(X.rects, X.rects_size * sizeof(*X.rects));
+            }
+            X.rects[n].x      = run->col * X.glyph_width;
+            X.rects[n].y      = run->row * X.glyph_height;
+            X.rects[n].width  = run->cells * X.glyph_width;
+            X.rects[n].height = X.glyph_height;
+            n++;
+        }
+        if (n > 0) {
+            XSetForeground(X.dpy, X.gc, bg);
+            XFillRectangles(X.dpy, X.pixmap, X.gc, X.rects, n);
+        }
+    }
+
+    for (; run < end; run++) {
+        if (!hit[run->row]) {
+            x_drawrun(run);
+        }
+    }
+
+    /* The rows are whole now, before the cursor is drawn over them */
+    for (i = 0; i < frame->rows; i++) {
+        if (!hit[frame->row[i].row]) {
+            x_row_cache_put(frame->row[i].key, frame->row[i].row);
+        }
+        hit[frame->row[i].row] = false;
+    }
+
+    if (frame->show_cursor) {
+        x_drawrun(&frame->cursor);
+    }
+    x_show();
+}
+
+void
+x_row_cache_reset(size_t cols, size_t rows)
+/* Drop the rows kept, and make room for rows of cols cells, within
+ * config.row_cache_size */
+{
+    size_t bytes = cols * X.glyph_width * X.glyph_height * 4;
+
+    if (X.row_cache.pixmap) {
+        XFreePixmap(X.dpy, X.row_cache.pixmap);
+        X.row_cache.pixmap = 0;
+    }
+
+    X.row_cache.width = cols * X.glyph_width;
+    X.row_cache.slots = bytes > 0 ? config.row_cache_size / bytes : 0;
+    X.row_cache.slots = X.shm.enabled ? 0 : X.row_cache.slots; /* Not used */
+    X.row_cache.slots = min(X.row_cache.slots, 32767 / max(X.glyph_height, 1)); /* Largest pixmap */
+    if (X.row_cache.slots > 0) {
+        X.row_cache.pixmap = XCreatePixmap(X.dpy,
+                                           X.window,
+                                           X.row_cache.width,
+                                           X.row_cache.slots * X.glyph_height,
+                                           XDefaultDepth(X.dpy, X.screen));
+    }
+    X.row_cache.key  = erealloc(X.row_cache.key,  (X.row_cache.slots + 1) * sizeof(*X.row_cache.key));
+    X.row_cache.used = erealloc(X.row_cache.used, (X.row_cache.slots + 1) * sizeof(*X.row_cache.used));
+    memset(X.row_cache.used, 0, (X.row_cache.slots + 1) * sizeof(*X.row_cache.used));
+
+    X.row_cache.rows = rows;
+    X.row_cache.hit  = erealloc(X.row_cache.hit, (rows + 1) * sizeof(*X.row_cache.hit));
+    memset(X.row_cache.hit, 0, (rows + 1) * sizeof(*X.row_cache.hit));
+}
+
+static size_t /* Return slots if key isn't kept */
+x_row_cache_find(uint64_t key)
+{
+    size_t slot;
+
+    for (slot = 0; slot < X.row_cache.slots; slot++) {
+        if (X.row_cache.key[slot] == key && X.row_cache.used[slot] != 0) {
+            break;
+        }
+    }
+    return slot;
+}
+
+struct row_cache_stats_t
+x_row_cache_stats()
+/* How well the row cache has done so far */
+{
+    struct row_cache_stats_t stats = {
+        .hits   = X.row_cache.hits,
+        .misses = X.row_cache.misses,
+        .slots  = X.row_cache.slots,
+    };
+    return stats;
+}
+
+bool /* Return false if the row wasn't kept */
+x_row_cache_get(uint64_t key, size_t row)
+/* Copy the row drawn with key to row on the pixmap */
+{
+    size_t slot = x_row_cache_find(key);
+
+    if (slot == X.row_cache.slots) {
+        X.row_cache.misses++;
+        return false;
+    }
+    XCopyArea(X.dpy,
+              X.row_cache.pixmap,
+              X.pixmap,
+              X.gc,
+              0, slot * X.glyph_height,
+              X.row_cache.width, X.glyph_height,
+              0, row * X.glyph_height);
+    X.row_cache.used[slot] = X.row_cache.frame;
+    X.row_cache.hits++;
+    return true;
+}
+
+void
+x_row_cache_put(uint64_t key, size_t row)
+/* Keep row of the pixmap, drawn with key, in place of the row least
+ * recently used */
+{
+    size_t slot = x_row_cache_find(key), i;
+
+    if (X.row_cache.slots == 0) {
+        return;
+    }
+    if (slot == X.row_cache.slots) {
+        for (slot = 0, i = 1; i < X.row_cache.slots; i++) {
+            if (X.row_cache.used[i] < X.row_cache.used[slot]) {
+                slot = i;
+            }
+        }
+        XCopyArea(X.dpy,
+                  X.pixmap,
+                  X.row_cache.pixmap,
+                  X.gc,
+                  0, row * X.glyph_height,
+                  X.row_cache.width, X.glyph_height,
+                  0, slot * X.glyph_height);
+        X.row_cache.key[slot] = key;
+    }
+    X.row_cache.used[slot] = X.row_cache.frame;
+}
+
+void
+x_scroll(size_t top, size_t bottom, int lines)
+/* Move rows top..bottom of the pixmap up by lines, or down if negative.
+ * The rows uncovered are painted in the same frame */
+{
+    size_t n = abs(lines);
+    size_t src = (lines > 0 ? top + n : top) * X.glyph_height;
+    size_t dst = (lines > 0 ? top : top + n) * X.glyph_height;
+
+    XCopyArea(X.dpy,
+              X.pixmap,
+              X.pixmap,
+              X.gc,
+              0, src,
+              X.win_width, (bottom - top + 1 - n) * X.glyph_height,
+              0, dst);
+}
+
+static bool x_shm_failed; /* See x_shm_on_error */
+
+static int
+x_shm_on_error(unused Display *dpy, unused XErrorEvent *event)
+/* Note the error instead of exiting, as Xlib would */
+{
+    x_shm_failed = true;
+    return 0;
+}
+
+void
+x_shm_fallback()
+/* Draw on the server after all */
+{
+    warning("No shared image, drawing on the server");
+    X.shm.enabled = false;
+    callbacks.draw_list = x_drawlist;
+    callbacks.row_keys = config.row_cache_size > 0;
+}
+
+bool /* Return false if the server can't share an image with us */
+x_shm_create(size_t width, size_t height)
+/* Replace the shared image with one of width by height, or none if 0 */
+{
+    int (*handler)(Display *, XErrorEvent *);
+
+    if (X.shm.image) {
+        XSync(X.dpy, False); /* Done with it, as we are */
+        XShmDetach(X.dpy, &X.shm.info);
+        XDestroyImage(X.shm.image);
+        shmdt(X.shm.info.shmaddr);
+        X.shm.image = NULL;
+        X.shm.busy = false;
+    }
+    if (width == 0 || height == 0) {
+        return true;
+    }
+
+    X.shm.image = XShmCreateImage(X.dpy,
+                                  XDefaultVisual(X.dpy, X.screen),
+                                  XDefaultDepth(X.dpy, X.screen),
+                                  ZPixmap,
+                                  NULL,
+                                  &X.shm.info,
+                                  width, height);
+    if (X.shm.image == NULL) {
+        return false;
+    }
+    if (X.shm.image->bits_per_pixel != 32) {
+        debug("%d bits per pixel", X.shm.image->bits_per_pixel);
+        XDestroyImage(X.shm.image);
+        X.shm.image = NULL;
+        return false;
+    }
+    X.shm.info.shmid = shmget(IPC_PRIVATE,
+                              X.shm.image->bytes_per_line * X.shm.image->height,
+                              IPC_CREAT | 0600);
+    if (X.shm.info.shmid < 0) {
+        debug("shmget failed: %d", errno);
+        XDestroyImage(X.shm.image);
+        X.shm.image = NULL;
+        return false;
+    }
+    X.shm.info.shmaddr = X.shm.image->data = shmat(X.shm.info.shmid, NULL, 0);
+    X.shm.info.readOnly = False;
+    /* Gone once both sides let go of it, exits and failures included */
+    shmctl(X.shm.info.shmid, IPC_RMID, NULL);
+    if (X.shm.info.shmaddr == (void *)-1) {
+        debug("shmat failed: %d", errno);
+        XDestroyImage(X.shm.image);
+        X.shm.image = NULL;
+        return false;
+    }
+
+    /* A server on another machine refuses with BadAccess */
+    XSync(X.dpy, False); /* Earlier errors go to the usual handler */
+    x_shm_failed = false;
+    handler = XSetErrorHandler(x_shm_on_error);
+    XShmAttach(X.dpy, &X.shm.info);
+    XSync(X.dpy, False);
+    XSetErrorHandler(handler);
+    if (x_shm_failed) {
+        XDestroyImage(X.shm.image);
+        shmdt(X.shm.info.shmaddr);
+        X.shm.image = NULL;
+        return false;
+    }
+    return true;
+}
+
+static inline uint32_t *
+x_shm_line(size_t y)
+{
+    return (uint32_t *)(X.shm.image->data + y * X.shm.image->bytes_per_line);
+}
+
+static const uint8_t * /* Return NULL if c has no glyph */
+x_shm_glyph(bool bold, wchar_t c)
+/* Return the glyph of c from the atlas, rows of 2 * glyph_width bytes,
+ * drawn into it the first time */
+{
+    size_t stride = 2 * X.glyph_width, bytes = stride * X.glyph_height;
+    uint32_t **page = &X.shm.slot[bold][(uint32_t)c >> 8];
+
+    if ((uint32_t)c >= 0x110000) {
+        return NULL;
+    }
+    if (*page == NULL) {
+        *page = emalloc(256 * sizeof(**page));
+        memset(*page, 0, 256 * sizeof(**page));
+    }
+    if ((*page)[c & 0xff] == 0) {
+        if (X.shm.atlas_slots == X.shm.atlas_size) {
+            X.shm.atlas_size = max(64, X.shm.atlas_size * 2);
+            X.shm.atlas = erealloc(X.shm.atlas, X.shm.atlas_size * bytes);
+        }
+        x_glyph_bits(bold, c,
+                     (char_width(c) > 1 ? 2 : 1) * X.glyph_width,
+                     X.shm.atlas + X.shm.atlas_slots * bytes,
+                     stride);
+        (*page)[c & 0xff] = ++X.shm.atlas_slots;
+    }
+    return X.shm.atlas + ((*page)[c & 0xff] - 1) * bytes;
+}
+
+static void
+x_shm_damage(size_t col, size_t row, size_t cells)
+{
+    if (row >= X.shm.rows) {
+        return;
+    }
+    X.shm.damage_from[row] = min(X.shm.damage_from[row], col);
+    X.shm.damage_to[row]   = max(X.shm.damage_to[row], min(col + cells, X.shm.cols));
+}
+
+void
+x_shm_damage_reset(size_t cols, size_t rows)
+/* Track damage to cols by rows cells. All of the window is sent next */
+{
+    size_t i;
+
+    X.shm.cols = cols;
+    X.shm.rows = rows;
+    X.shm.damage_from = erealloc(X.shm.damage_from, (rows + 1) * sizeof(*X.shm.damage_from));
+    X.shm.damage_to   = erealloc(X.shm.damage_to,   (rows + 1) * sizeof(*X.shm.damage_to));
+    for (i = 0; i < rows; i++) {
+        X.shm.damage_from[i] = cols;
+        X.shm.damage_to[i]   = 0;
+    }
+    X.shm.damage_all = true;
+}
+
+static void
+x_shm_glyph_put(size_t x, size_t y, size_t right, const uint8_t *glyph, color_t fg)
+/* Set the pixels of glyph at x, y, up to right, to fg */
+{
+    size_t stride = 2 * X.glyph_width, width, i;
+
+    if (glyph == NULL || x >= right) {
+        return;
+    }
+    width = min(stride, right - x);
+    for (i = 0; i < X.glyph_height; i++) {
+        kernels.mask_pixels(x_shm_line(y + i) + x, glyph + i * stride, fg, width);
+    }
+}
+
+static void
+x_shm_drawrun(const struct draw_run_t *run)
+/* Draw a run into the shared image: its background, then its glyphs, and
+ * its underline */
+{
+    size_t x = run->col * X.glyph_width, y = run->row * X.glyph_height;
+    size_t right = min(x + run->cells * X.glyph_width, (size_t)X.shm.image->width);
+    size_t i;
+    wchar_t c;
+
+    if (y + X.glyph_height > (size_t)X.shm.image->height || x >= right) {
+        return;
+    }
+    for (i = 0; i < X.glyph_height; i++) {
+        kernels.fill_pixels(x_shm_line(y + i) + x, run->bg, right - x);
+    }
+    x_shm_damage(run->col, run->row, run->cells);
+    if (run->text == NULL) {
+        return;
+    }
+
+    if (run->cluster) {
+        /* The base character and the combining ones, all in one cell */
+        for (i = 0; i < run->length; i++) {
+            x_shm_glyph_put(x, y, right, x_shm_glyph(run->bold, run->text[i]), run->fg);
+        }
+    }
+    else {
+        for (i = 0; i < run->length; i++) {
+            c = run->text[i];
+            if (c != L'\0' && c != L' ') { /* Blanks are the background */
+                x_shm_glyph_put(x, y, right, x_shm_glyph(run->bold, c), run->fg);
+            }
+            x += (char_width(c) > 1 ? 2 : 1) * X.glyph_width;
+        }
+    }
+    if (run->underline && X.glyph_ascent + 1 < X.glyph_height) {
+        x = run->col * X.glyph_width;
+        kernels.fill_pixels(x_shm_line(y + X.glyph_ascent + 1) + x, run->fg, right - x);
+    }
+}
+
+static void
+x_shm_scroll(size_t top, size_t bottom, int lines)
+/* As x_scroll, in the shared image */
+{
+    size_t n = abs(lines), i;
+    size_t src = (lines > 0 ? top + n : top) * X.glyph_height;
+    size_t dst = (lines > 0 ? top : top + n) * X.glyph_height;
+
+    memmove(x_shm_line(dst),
+            x_shm_line(src),
+            (bottom - top + 1 - n) * X.glyph_height * X.shm.image->bytes_per_line);
+    for (i = top; i <= bottom; i++) {
+        x_shm_damage(0, i, X.shm.cols);
+    }
+}
+
+static void
+x_shm_show()
+/* Send the damaged parts of the image to the window. Rows one below the
+ * other damaged alike go together */
+{
+    size_t row, end;
+
+    if (X.shm.damage_all) {
+        XShmPutImage(X.dpy, X.window, X.gc, X.shm.image,
+                     0, 0, 0, 0, X.win_width, X.win_height, False);
+        X.shm.busy = true;
+    }
+    for (row = 0; row < X.shm.rows; row = end) {
+        for (end = row + 1;
+             end < X.shm.rows &&
+             X.shm.damage_from[end] == X.shm.damage_from[row] &&
+             X.shm.damage_to[end] == X.shm.damage_to[row];
+             end++);
+        if (X.shm.damage_from[row] < X.shm.damage_to[row] && !X.shm.damage_all) {
+            XShmPutImage(X.dpy, X.window, X.gc, X.shm.image,
+                         X.shm.damage_from[row] * X.glyph_width, row * X.glyph_height,
+                         X.shm.damage_from[row] * X.glyph_width, row * X.glyph_height,
+                         (X.shm.damage_to[row] - X.shm.damage_from[row]) * X.glyph_width,
+                         (end - row) * X.glyph_height,
+                         False);
+            X.shm.busy = true;
+        }
+    }
+    for (row = 0; row < X.shm.rows; row++) {
+        X.shm.damage_from[row] = X.shm.cols;
+        X.shm.damage_to[row]   = 0;
+    }
+    X.shm.damage_all = false;
+}
+
+void
+x_shm_drawlist(const struct draw_frame_t *frame)
+/* Draw a frame into the shared image, and send what changed. Puts are
+ * asked without completion events, which would wake run() from passive,
+ * so the image isn't written to until a round trip after the last */
+{
+    size_t i;
+
+    if (X.shm.image == NULL) {
+        return;
+    }
+    if (X.shm.busy) {
+        XSync(X.dpy, False);
+        X.shm.busy = false;
+    }
+    if (frame->scroll.lines != 0) {
+        x_shm_scroll(frame->scroll.top, frame->scroll.bottom, frame->scroll.lines);
+    }
+    for (i = 0; i < frame->runs; i++) {
+        x_shm_drawrun(&frame->run[i]);
+    }
+    if (frame->show_cursor) {
+        x_shm_drawrun(&frame->cursor);
+    }
+    x_shm_show();
+}
+
 void
 x_show()
 {
@@ -317,17 +1044,18 @@ x_draw()
 void
 x_on_configure(XEvent *event)
 {
-    size_t w = event->xconfigure.width;
-    size_t h = event->xconfigure.height;
-    x_resize(w, h);
-
+    /* Only the last size of a burst is used, see run() */
+    X.configure.pending = true;
+    X.configure.width   = event->xconfigure.width;
+    X.configure.height  = event->xconfigure.height;
 }
 
 void
 x_on_expose(unused XEvent *event)
 {
+    X.shm.damage_all = true;
     term_invalidate();
-    x_draw();
+    timerclear(&X.last_draw); /* Draw in this round of run() */
 }
 
 void
@@ -349,29 +1077,53 @@ x_on_keypress(XEvent *event)
 void
 on_reschange(size_t cols, size_t rows)
 {
-    /* Clear window */
-	XSetForeground(X.dpy,
-                   X.gc,
-                   config.background);
-	XFillRectangle(X.dpy,
-                   X.pixmap,
-                   X.gc,
-                   0,
-                   0,
-                   X.win_width,
-                   X.win_height);
+    /* Clear the border right and below the cells, which are all repainted */
+    x_fill(cols * X.glyph_width,
+           0,
+           X.win_width - min(X.win_width, cols * X.glyph_width),
+           X.win_height,
+           config.background);
+    x_fill(0,
+           rows * X.glyph_height,
+           X.win_width,
+           X.win_height - min(X.win_height, rows * X.glyph_height),
+           config.background);
+
+    /* Rows kept were as wide as before */
+    x_row_cache_reset(cols, rows);
+    if (X.shm.enabled) {
+        x_shm_damage_reset(cols, rows);
+    }
+
+    /* Report new size once it settles */
+    X.winsize.pending = true;
+    X.winsize.cols = cols;
+    X.winsize.rows = rows;
+    gettimeofday(&X.winsize.changed, NULL);
 
-    /* Report new size */
+    /* Order a full repaint */
+    term_invalidate();
+}
+
+void
+report_winsize(struct timeval now)
+/* Tell the shell about the new size, if it hasn't changed for a while */
+{
     struct winsize w;
-    w.ws_row = rows;
-    w.ws_col = cols;
+
+    if (!X.winsize.pending ||
+        timediff_usec(now, X.winsize.changed) <
+            (uint64_t)(config.resize_delay.tv_sec * 1000000 + config.resize_delay.tv_usec)) {
+        return;
+    }
+    X.winsize.pending = false;
+
+    w.ws_row = X.winsize.rows;
+    w.ws_col = X.winsize.cols;
     w.ws_xpixel = w.ws_ypixel = 0;
     if (ioctl(shell_fd, TIOCSWINSZ, &w) < 0) {
         debug("ioctl failed: %d", errno);
     }
-
-    /* Order a full repaint */
-    term_invalidate();
 }
 
 
@@ -427,10 +1179,16 @@ run()
                 (x_handler[event.type])(&event);
         }
 
+        if (X.configure.pending) {
+            X.configure.pending = false;
+            x_resize(X.configure.width, X.configure.height);
+        }
+
         gettimeofday(&now, NULL);
         if (timediff_usec(now, X.last_draw) > (passive ? usec_sleep_passive : usec_sleep)) {
             x_draw();
         }
+        report_winsize(now);
 
         if (FD_ISSET(Xfd, &fds)) {
             gettimeofday(&last_event, NULL);
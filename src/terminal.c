@@ -3,13 +3,16 @@
 #include <string.h>
 
 #include <sys/time.h>
+#include <unistd.h>
 
 /* term_function_key constants */
 #include <X11/keysym.h>
 
 #include "terminal.h"
 #include "escparse.h"
+#include "kernels.h"
 #include "util.h"
+#include "wcwidth.h"
 
 #include "config.h"
 #include "keymap.h"
@@ -26,6 +29,7 @@ static void term_setcharattributes(int32_t arg[]);
 static void term_setscrollregion(size_t top, size_t bottom);
 static void term_tab_move(int n);
 static void term_writechar(const wchar_t ucs2char);
+static void term_write_run(const uint32_t *cps, size_t n);
 
 static void esc_dispatch(char function, char intermediate);
 static void csi_dispatch(char function, int32_t arg[], char privflag);
@@ -73,20 +77,98 @@ enum {
     CHAR_ATTR_BLINK     = 0x04,
     CHAR_ATTR_INVERSE   = 0x08,
     CHAR_ATTR_INVISIBLE = 0x10,
+    CHAR_ATTR_COMBINED  = 0x20, /* c is a cluster id, see cluster_get() */
 };
 
-struct glyph_t {
-    wchar_t     c;
-    color_t     foreground;
-    color_t     background;
-    char_attr_t attr;
+/* Colors are stored as indexes, and looked up with term_color() when
+ * painted. 0 is the default color, so an all zero cell is blank in the
+ * default colors.
+ */
+typedef uint16_t color_index_t;
+enum {
+    COLOR_DEFAULT   = 0,                    /* config.foreground / background */
+    COLOR_PALETTE   = 1,                    /* config.color[0] */
+    COLOR_TRUECOLOR = COLOR_PALETTE + 256,  /* terminal.truecolor.color[0] */
+    COLORS_MAX      = 0xffff,
+};
+
+struct style_t {
+    color_index_t   foreground;
+    color_index_t   background;
+    char_attr_t     attr;
+};
+
+/* Styles are interned per terminal, and cells refer to them by id. Id 0
+ * is the default style.
+ */
+typedef uint16_t style_id_t;
+#define STYLES_MAX 0xffff
+#define STYLE_UNKNOWN STYLES_MAX /* Never interned, see front_forget */
+
+/* Double width glyphs are stored in the leftmost cell, and the cell to the
+ * right of it holds this marker. It is outside of unicode, so it can never
+ * be printed by the host.
+ */
+#define GLYPH_WIDE_TAIL ((wchar_t)0x110000)
+
+/* The grid is an array of lines in screen order. Scrolling moves lines
+ * around, never their cells. Cells are kept as parallel arrays, so runs of
+ * text can be passed to the renderer as they are.
+ * Erasing a whole line only marks it blank. Its cells are filled in when
+ * the line is next written to, see line_materialize.
+ */
+struct line_t {
+    wchar_t        *text;  /* codepoints, one per column */
+    style_id_t     *style; /* style of each cell in text */
+    size_t          blink; /* Blinking cells. May count cells since overwritten,
+                              term_invalidate_blinkers recounts */
+    bool            blank; /* All cells are '\0' in blank_style, text and style are stale */
+    style_id_t      blank_style;
+    uint64_t        hash;  /* Of text and style if hashed, see line_rehash */
+    bool            hashed;
+};
+
+struct grid_t {
+    struct line_t  *line;  /* one per row */
+    wchar_t        *text;  /* storage for all lines, in no particular order */
+    style_id_t     *style;
+    size_t          cols, rows; /* Allocated size, the terminal may use less */
+};
+
+/* Grids grow in steps, so that a window being resized doesn't reallocate
+ * at every size it passes through */
+#define GRID_COLS_STEP 64
+#define GRID_ROWS_STEP 16
+
+/* A base character followed by its combining characters. Cells that have
+ * combining characters refer to one of these by id, so that the common
+ * case doesn't pay for them.
+ */
+#define CLUSTER_LENGTH 8 /* Further combining characters are dropped */
+#define CLUSTERS_MAX   0xffff
+
+struct cluster_t {
+    wchar_t     c[CLUSTER_LENGTH];
+    size_t      length;
+};
+
+/* What DECSC saves and DECRC restores. Each screen has its own */
+struct saved_cur_t {
+    size_t      x, y; /* cursor position */
+    bool        autowrap;
+    bool        origin_mode;
+    struct style_t style;
+    enum charset_t  charset[NUM_CHARSET_MODES];
+    enum charset_mode_t  charset_mode;
 };
 
 
 static struct {
     size_t          cols, rows;
-    struct glyph_t *text; /* circular buffer */
-    size_t          ring_top; /* top of scroll ring within page address space */
+    struct grid_t   grid;
+    struct grid_t   inactive; /* The screen not shown, allocated on first use */
+    bool            alt_screen; /* Is the alternate screen shown? */
+    struct grid_t   front; /* What is on screen, as last painted */
 
     size_t          x, y; /* cursor position (scren address space) */
 
@@ -98,10 +180,26 @@ static struct {
                      * page is the current active (depenedent on e.g. origin mode
                      */
     struct {
-        size_t      left;
-        size_t      right; /* First *clean* character */
-    }              *dirty; /* For each line, what is the leftmost and rightmost dirty character */
+        uint64_t   *rows;  /* Bit per row with dirty cells */
+        uint64_t   *cells; /* Bit per dirty cell, words words for each row */
+        size_t      words;
+    }               dirty;
     bool            cursor_dirty;
+    struct {
+        size_t      x, y;
+    }               cursor_painted; /* Where the cursor was last painted */
+    struct {
+        size_t      top, bottom;
+        int         lines;
+    }               scroll; /* Scroll not yet passed to term_cb->scroll */
+    struct {
+        struct draw_frame_t frame; /* Runs not grouped yet */
+        size_t      size; /* Of frame.run */
+        bool        cursor; /* Painting into frame.cursor */
+        bool        cursor_covered; /* The cell of cursor_painted was
+                                       painted in this frame */
+        uint64_t    generation; /* Changes what ids in rows stand for */
+    }               list; /* The frame gathered for term_cb->draw_list */
     wchar_t         lastchar;   /* Most recently printed character. TODO: remove for speed? */
 
     /* mode flags */
@@ -124,25 +222,46 @@ static struct {
     enum col_mode_t col_mode;
     bool            no_clear_on_col_mode_change; /* DECNCSM */
 
-    struct {
-        uint32_t    foreground;
-        uint32_t    background;
-        char_attr_t attr;
-    } style;
+    struct style_t  style;
+    style_id_t      style_id;   /* style, interned */
     bool            blinked;    /* true if blinked characters are currently hidden */
 
-    struct {
-        size_t      x, y; /* cursor position */
-        bool        autowrap;
-        bool        origin_mode;
-        uint32_t    foreground;
-        uint32_t    background;
-        char_attr_t attr;
-        enum charset_t  charset[NUM_CHARSET_MODES];
-        enum charset_mode_t  charset_mode;
-    } saved_cur;  /* Store DECSC / DECRC info */
+    struct saved_cur_t saved_cur; /* Of the screen shown */
+    struct saved_cur_t inactive_saved_cur; /* Of the screen not shown */
 
     bool           *tabstop; /* array, one element per col */
+
+    struct arena_t  arena; /* Scratch memory, released every frame */
+
+    struct {
+        uint64_t   *key;  /* Random odd multiplier per column */
+        uint64_t    sum;  /* Of the keys of the columns in use */
+        uint64_t    seed;
+    }               hash; /* See line_rehash */
+
+    struct {
+        struct style_t *style;
+        size_t      count;
+        size_t      size;
+        style_id_t *index; /* Hash of style to 1 + id */
+        size_t      index_size; /* Power of two */
+    } styles;
+
+    struct {
+        struct cluster_t *cluster; /* Slot 0 is unused, so no id is '\0' */
+        size_t      count;
+        size_t      size;
+        uint32_t   *index; /* Hash of cluster contents to id, 0 is empty */
+        size_t      index_size; /* Power of two */
+    } clusters;
+
+    struct {
+        color_t    *color; /* Colors set by RGB value, see COLOR_TRUECOLOR */
+        size_t      count;
+        size_t      size;
+        uint16_t   *index; /* Hash of color to 1 + position in color */
+        size_t      index_size; /* Power of two */
+    } truecolor;
 } terminal;
 
 static struct term_push_callbacks *term_cb;
@@ -166,12 +285,6 @@ static struct term_push_callbacks *term_cb;
 static inline size_t PAGE(size_t x, size_t y)
 {
     y = min(y, terminal.page.height - 1);
-    y += terminal.ring_top;
-    if (y >= terminal.page.height) {
-        y -= terminal.page.height;
-    }
-
-    assert (y < terminal.page.height);
     y += terminal.page.top;
 
     return y * terminal.cols + min(x, EOL);
@@ -183,85 +296,281 @@ static inline size_t PAGE(size_t x, size_t y)
  */
 static inline size_t SCREEN(size_t x, size_t y)
 {
-    y = min(y, BOTTOM);
+    return min(y, BOTTOM) * terminal.cols + min(x, EOL);
+}
+
+static void
+bits_set(uint64_t *bits, size_t from, size_t to)
+/* Set bits from..to (exclusive) */
+{
+    size_t i, first = from / 64, last = (to - 1) / 64;
+    uint64_t head, tail;
 
-    if (between(y, terminal.page.top, terminal.page.bottom)) {
-        return PAGE(x, y - terminal.page.top);
+    if (from >= to) {
+        return;
     }
-    else {
-        return y * terminal.cols + min(x, EOL);
+
+    head = ~0ULL << (from % 64);
+    tail = ~0ULL >> (63 - (to - 1) % 64);
+    if (first == last) {
+        bits[first] |= head & tail;
+        return;
     }
+    bits[first] |= head;
+    for (i = first + 1; i < last; i++) {
+        bits[i] = ~0ULL;
+    }
+    bits[last] |= tail;
 }
 
-void
-term_align(size_t *p1, size_t *p2, size_t *p3)
-/* Ring buffer gotcha */
-/* Call this before code that requires the top row to start at terminal.x */
-/* arguments are updated to reflect the new alignment */
-/* an aligned buffer also makes execution a little faster */
-{
-    if (terminal.ring_top != 0) {
-        debug("Realigning");
-        struct glyph_t *newtext = emalloc(terminal.cols * terminal.rows * sizeof(*newtext));
-
-        size_t rowbytes = terminal.cols * sizeof(*newtext);
-
-        size_t rowsdone = 0, numrows = 0;
-
-        /* 1. Above top margin */
-        numrows = terminal.margin.top;
-        memcpy(newtext,
-                    terminal.text,
-                    numrows * rowbytes);
-        rowsdone += numrows;
-
-        /* 2. ring_top to bottom margin */
-        numrows = terminal.margin.height - terminal.ring_top;
-        memcpy(newtext + rowsdone * terminal.cols,
-                    terminal.text + (terminal.margin.top + terminal.ring_top) * terminal.cols,
-                    numrows * rowbytes);
-        rowsdone += numrows;
-
-        /* 3. top margin to ring_top */
-        numrows = terminal.ring_top;
-        memcpy(newtext + rowsdone * terminal.cols,
-                    terminal.text + terminal.margin.top * terminal.cols,
-                    numrows * rowbytes);
-        rowsdone += numrows;
-
-        /* 4. Below bottom margin */
-        numrows = terminal.rows - (terminal.margin.top + terminal.margin.height);
-        memcpy(newtext + rowsdone * terminal.cols,
-                    terminal.text + (terminal.margin.bottom+ 1) * terminal.cols,
-                    numrows * rowbytes);
-        rowsdone += numrows;
-
-        size_t topmargin = terminal.margin.top * terminal.cols;
-        size_t bottommargin = terminal.margin.bottom * terminal.cols;
-        size_t topring = (terminal.margin.top + terminal.ring_top) * terminal.cols;
-#define REALIGN(p) do {if (p) {\
-                        if(between(*p, topmargin, bottommargin)) { \
-                            if (between(*p, topmargin, topring - 1)) \
-                                *p += terminal.margin.height * terminal.cols; \
-                            *p -= terminal.ring_top * terminal.cols; \
-                        } \
-                    }} while(0)
-
-        REALIGN(p1);
-        REALIGN(p2);
-        REALIGN(p3);
-#undef REALIGN
-
-        free(terminal.text);
-        terminal.text = newtext;
-        terminal.ring_top  = 0;
+static size_t
+bits_next(const uint64_t *bits, size_t from, size_t n, bool set)
+/* Return the first of bits from..n that is set, or clear if set is false.
+ * n if there is none */
+{
+    size_t i = from / 64;
+    uint64_t flip = set ? 0 : ~0ULL;
+    uint64_t word;
+
+    if (from >= n) {
+        return n;
+    }
+
+    word = (bits[i] ^ flip) & (~0ULL << (from % 64));
+    while (word == 0) {
+        if (++i * 64 >= n) {
+            return n;
+        }
+        word = bits[i] ^ flip;
+    }
+    return min(n, i * 64 + __builtin_ctzll(word));
+}
+
+static inline uint64_t *
+DIRTY(size_t row)
+/* Dirty cell bits of row */
+{
+    return terminal.dirty.cells + row * terminal.dirty.words;
+}
+
+static inline void
+term_damage(size_t row, size_t left, size_t right)
+/* Mark cells left..right (exclusive) of row to be repainted */
+{
+    if (left < right) {
+        bits_set(DIRTY(row), left, right);
+        terminal.dirty.rows[row / 64] |= 1ULL << (row % 64);
+    }
+}
+
+static inline uint64_t
+splitmix64(uint64_t x)
+/* Mix the bits of x, for keys that look random */
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t
+cell_key(wchar_t c, style_id_t style)
+{
+    return (uint64_t)(uint32_t)c << 16 | style;
+}
+
+static uint64_t
+line_rehash(struct line_t *line)
+/* Hash the cells of a line as the sum of key * cell over columns. A cell
+ * written only changes its own term, see cell_set, and a blank line hashes
+ * to blank_style * sum */
+{
+    size_t col;
+    uint64_t hash = 0;
+
+    for (col = 0; col < terminal.cols; col++) {
+        hash += terminal.hash.key[col] * cell_key(line->text[col], line->style[col]);
+    }
+    line->hash = hash;
+    line->hashed = true;
+    return hash;
+}
+
+static inline bool /* Return false if the hash isn't known */
+line_hash(const struct line_t *line, uint64_t *hash)
+{
+    if (line->blank) {
+        *hash = line->blank_style * terminal.hash.sum;
+        return line->blank_style != STYLE_UNKNOWN;
+    }
+    *hash = line->hash;
+    return line->hashed;
+}
+
+static inline struct line_t *
+line_materialize(struct line_t *line, size_t cols)
+/* Fill in the cells of a blank line, before they are read or written */
+{
+    if (line->blank) {
+        memset(line->text, 0, cols * sizeof(*line->text));
+        kernels.fill_style(line->style, line->blank_style, cols);
+        line->blank = false;
+        line->hash = line->blank_style * terminal.hash.sum;
+        line->hashed = line->blank_style != STYLE_UNKNOWN;
+    }
+    return line;
+}
+
+/* Longer runs of text leave the line unhashed. Keeping the hash costs a
+ * tenth of the time to write them, and term_front_diff compares their
+ * cells about as fast */
+#define HASH_RUN_MAX 16
+
+static inline void
+cell_set(struct line_t *line, size_t col, wchar_t c, style_id_t style)
+/* Write a cell of a materialized line, and update its hash */
+{
+    line->hash += terminal.hash.key[col] *
+        (cell_key(c, style) - cell_key(line->text[col], line->style[col]));
+    line->text[col]  = c;
+    line->style[col] = style;
+}
+
+/* Line holding cell index */
+static inline struct line_t *LINE(size_t i)
+{
+    return terminal.grid.line + i / terminal.cols;
+}
+
+/* Codepoint at cell index */
+static inline wchar_t *TEXT(size_t i)
+{
+    return line_materialize(terminal.grid.line + i / terminal.cols, terminal.cols)->text
+           + i % terminal.cols;
+}
+
+/* Style at cell index */
+static inline style_id_t *STYLE(size_t i)
+{
+    return line_materialize(terminal.grid.line + i / terminal.cols, terminal.cols)->style
+           + i % terminal.cols;
+}
+
+static void
+grid_alloc(struct grid_t *grid, size_t cols, size_t rows)
+/* Allocate a blank grid */
+{
+    size_t i;
+
+    grid->cols  = cols;
+    grid->rows  = rows;
+    grid->line  = emalloc(rows * sizeof(*grid->line));
+    grid->text  = emalloc(cols * rows * sizeof(*grid->text));
+    grid->style = emalloc(cols * rows * sizeof(*grid->style));
+
+    for (i = 0; i < rows; i++) {
+        grid->line[i].text  = grid->text  + i * cols;
+        grid->line[i].style = grid->style + i * cols;
+        grid->line[i].blink = 0;
+        grid->line[i].blank = true;
+        grid->line[i].blank_style = 0;
+        grid->line[i].hashed = false;
+    }
+}
+
+static void
+grid_free(struct grid_t *grid)
+{
+    free(grid->line);
+    free(grid->text);
+    free(grid->style);
+    memset(grid, 0, sizeof(*grid));
+}
+
+static void
+grid_clear(struct grid_t *grid)
+/* Blank all cells of a grid */
+{
+    size_t i;
 
+    for (i = 0; i < terminal.rows; i++) {
+        grid->line[i].blink = 0;
+        grid->line[i].blank = true;
+        grid->line[i].blank_style = 0;
     }
 }
 
+static inline bool
+line_stretches(const struct line_t *line)
+/* Would the style of a blank line spread over columns added to it? */
+{
+    return line->blank && line->blank_style != 0 && line->blank_style != STYLE_UNKNOWN;
+}
+
+static void
+grid_resize(struct grid_t *grid, size_t cols, size_t rows)
+/* Resize a grid of the current size to cols x rows, keeping the top left
+ * part of its content. Within the allocated size, nothing is moved. Cells
+ * uncovered on the right get the default style, also on blank lines of
+ * another style, which are materialized so as not to stretch it */
+{
+    size_t i;
+    struct line_t *line;
+    struct grid_t new;
+
+    if (cols <= grid->cols && rows <= grid->rows) {
+        for (i = 0, line = grid->line; i < min(rows, terminal.rows); i++, line++) {
+            if (cols > terminal.cols && line_stretches(line)) {
+                line_materialize(line, terminal.cols);
+            }
+            line->hashed = false; /* Over other columns */
+            if (!line->blank && cols > terminal.cols) {
+                /* Cells uncovered on the right may be stale */
+                memset(line->text + terminal.cols, 0,
+                       (cols - terminal.cols) * sizeof(*line->text));
+                memset(line->style + terminal.cols, 0,
+                       (cols - terminal.cols) * sizeof(*line->style));
+            }
+        }
+        for (; i < rows; i++, line++) {
+            line->blink = 0;
+            line->blank = true;
+            line->blank_style = 0;
+        }
+        return;
+    }
+
+    grid_alloc(&new,
+               (max(cols, grid->cols) + GRID_COLS_STEP - 1) / GRID_COLS_STEP * GRID_COLS_STEP,
+               (max(rows, grid->rows) + GRID_ROWS_STEP - 1) / GRID_ROWS_STEP * GRID_ROWS_STEP);
+    for (i = 0; i < min(rows, terminal.rows); i ++) {
+        if (grid->line[i].blank && !(cols > terminal.cols && line_stretches(grid->line + i))) {
+            new.line[i].blank_style = grid->line[i].blank_style;
+            continue;
+        }
+        line_materialize(new.line + i, new.cols);
+        if (grid->line[i].blank) {
+            kernels.fill_style(new.line[i].style, grid->line[i].blank_style,
+                               min(cols, terminal.cols));
+            new.line[i].hashed = false;
+            continue;
+        }
+        new.line[i].hashed = false;
+        new.line[i].blink = grid->line[i].blink;
+        memcpy(new.line[i].text,
+               grid->line[i].text,
+               sizeof(wchar_t) * min(cols, terminal.cols));
+        memcpy(new.line[i].style,
+               grid->line[i].style,
+               sizeof(style_id_t) * min(cols, terminal.cols));
+    }
+
+    grid_free(grid);
+    *grid = new;
+}
 
 static unused void
-term_dump(struct glyph_t *text)
+term_dump()
 /* Useful for debugging */
 {
     size_t y, x;
@@ -270,8 +579,7 @@ term_dump(struct glyph_t *text)
     printf("-----------------------------\n");
     for (y = 0; y < terminal.rows; y ++) {
         for (x = 0; x < terminal.cols; x ++) {
-            /*t = text[SCREEN(x, y)].c;*/
-            t = text[y * terminal.cols + x].c;
+            t = *TEXT(SCREEN(x, y));
             printf("%c", t != '\0' ? (char)t & 0xFF : ' ');
         }
         printf("\n");
@@ -281,333 +589,1719 @@ term_dump(struct glyph_t *text)
 
 /* }}} */
 
-void
-term_gc()
-/* Set terminal in an optimal state. Not nescessary, but may improve
- * performance later
- */
+/* Styles {{{ */
+
+static inline struct style_t
+style_get(style_id_t id)
+{
+    assert(id < terminal.styles.count);
+    return terminal.styles.style[id];
+}
+
+static inline uint32_t
+style_hash(struct style_t style)
+{
+    uint32_t h = ((uint32_t)style.foreground << 16 | style.background) ^
+                 (uint32_t)style.attr << 8;
+
+    /* The index is masked, so fold the high bits down */
+    h *= 0x85ebca6bu;
+    return h ^ (h >> 16);
+}
+
+static inline bool
+style_equal(struct style_t a, struct style_t b)
 {
-    term_align(NULL, NULL, NULL);
+    return a.foreground == b.foreground &&
+           a.background == b.background &&
+           a.attr       == b.attr;
 }
 
 static void
-term_cursor(size_t x, size_t y)
+style_index_add(style_id_t id)
 {
-    terminal.x = min(x, EOL);
-    terminal.y = min(y + terminal.page.top, terminal.page.bottom);
+    uint32_t mask = terminal.styles.index_size - 1;
+    size_t i;
 
-    terminal.wrap_next = false;
-    terminal.cursor_dirty = true;
+    i = style_hash(terminal.styles.style[id]) & mask;
+    while (terminal.styles.index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    terminal.styles.index[i] = id + 1;
 }
 
+static void
+style_reindex()
+{
+    size_t id;
+
+    while (terminal.styles.index_size < 2 * terminal.styles.size) {
+        terminal.styles.index_size = max(terminal.styles.index_size * 2, 64);
+    }
+    terminal.styles.index = erealloc(terminal.styles.index,
+            terminal.styles.index_size * sizeof(*terminal.styles.index));
+    memset(terminal.styles.index, 0,
+            terminal.styles.index_size * sizeof(*terminal.styles.index));
+
+    for (id = 0; id < terminal.styles.count; id++) {
+        style_index_add(id);
+    }
+}
 
+static void style_gc();
+static void front_forget(size_t row, size_t left, size_t right);
 
 static void
-term_fill(size_t from, size_t to, wchar_t c)
+grids_renumbered()
+/* Ids in the grids have changed, so their hashes and the front grid are
+ * no longer right */
 {
-    if (from > to) {
-        term_align(&from, &to, NULL);
+    size_t row;
+
+    for (row = 0; row < terminal.rows; row++) {
+        terminal.grid.line[row].hashed = false;
+        if (terminal.inactive.line != NULL) {
+            terminal.inactive.line[row].hashed = false;
+        }
+        front_forget(row, BOL, EOL + 1);
     }
+    terminal.list.generation++; /* Row keys from before mean other things */
+}
 
-    size_t i;
-    struct glyph_t *current;
+static style_id_t
+style_intern(struct style_t style)
+/* Return the id of a style, adding it if new */
+{
+    uint32_t mask;
+    size_t i, id;
+
+    mask = terminal.styles.index_size - 1;
+    for (i = style_hash(style) & mask;
+         terminal.styles.index[i] != 0;
+         i = (i + 1) & mask) {
+        id = terminal.styles.index[i] - 1;
+        if (style_equal(terminal.styles.style[id], style)) {
+            return id;
+        }
+    }
 
-    for (i = from, current = terminal.text + from; i <= to; i++) {
-        current->c = c;
-        current->foreground = terminal.style.foreground;
-        current->background = terminal.style.background;
-        current->attr       = terminal.style.attr;
+    if (terminal.styles.count >= STYLES_MAX) {
+        style_gc(); /* Can't wait for idle time */
+        if (terminal.styles.count >= STYLES_MAX) {
+            warning("Out of styles");
+            return 0;
+        }
+    }
 
-        current += 1;
+    id = terminal.styles.count++;
+    if (id >= terminal.styles.size) {
+        terminal.styles.size = max(terminal.styles.size * 2, 64);
+        terminal.styles.style = erealloc(terminal.styles.style,
+                terminal.styles.size * sizeof(*terminal.styles.style));
     }
+    terminal.styles.style[id] = style;
 
-    term_invalidate_range(from, to);
+    if (terminal.styles.index_size < 2 * terminal.styles.size) {
+        style_reindex();
+    }
+    else {
+        style_index_add(id);
+    }
+    return id;
 }
 
+static style_id_t
+style_set_attr(style_id_t id, char_attr_t attr, bool set)
+/* Return id of the same style with attr set or cleared */
+{
+    struct style_t style = style_get(id);
+
+    if ((bool)(style.attr & attr) == set) {
+        return id;
+    }
+    style.attr ^= attr;
+    return style_intern(style);
+}
 
 static void
-term_erase(size_t from, size_t to)
+style_clear()
+/* Forget all styles but the default */
 {
-    if (from > to) {
-        term_align(&from, &to, NULL);
+    if (terminal.styles.size == 0) {
+        terminal.styles.size = 64;
+        terminal.styles.style = emalloc(terminal.styles.size * sizeof(*terminal.styles.style));
     }
+    terminal.styles.count = 0;
+    style_reindex();
 
-    memset(terminal.text + from, 0, (to - from + 1) * sizeof(*terminal.text));
+    terminal.style.foreground = COLOR_DEFAULT;
+    terminal.style.background = COLOR_DEFAULT;
+    terminal.style.attr       = CHAR_ATTR_NONE;
+    terminal.style_id = style_intern(terminal.style);
+}
 
-    /* BCE - Background Color Erase */
-    if (config.bce) {
-        size_t i;
-        struct glyph_t *g;
-        for (i = from, g = terminal.text + from; i <= to; i++, g++) {
-            g->foreground = terminal.style.foreground;
-            g->background = terminal.style.background;
+static void
+style_gc()
+/* Drop styles no longer on either screen, and renumber the rest */
+{
+    size_t row, col, g, id, count;
+    style_id_t *map;
+    struct line_t *line;
+    struct grid_t *grids[] = {&terminal.grid, &terminal.inactive};
+
+    map = arena_alloc(&terminal.arena, terminal.styles.count * sizeof(*map));
+    memset(map, 0, terminal.styles.count * sizeof(*map));
+
+    map[0] = 1; /* The default style stays at 0 */
+    map[terminal.style_id] = 1;
+    for (g = 0; g < LENGTH(grids) && grids[g]->line != NULL; g++) {
+        for (row = 0, line = grids[g]->line; row < terminal.rows; row++, line++) {
+            if (line->blank) {
+                map[line->blank_style] = 1;
+                continue;
+            }
+            for (col = 0; col < terminal.cols; col++) {
+                map[line->style[col]] = 1;
+            }
         }
     }
 
-    term_invalidate_range(from, to);
+    for (id = count = 0; id < terminal.styles.count; id++) {
+        if (map[id]) {
+            terminal.styles.style[count] = terminal.styles.style[id];
+            map[id] = count++;
+        }
+    }
+
+    for (g = 0; g < LENGTH(grids) && grids[g]->line != NULL; g++) {
+        for (row = 0, line = grids[g]->line; row < terminal.rows; row++, line++) {
+            if (line->blank) {
+                line->blank_style = map[line->blank_style];
+                continue;
+            }
+            for (col = 0; col < terminal.cols; col++) {
+                line->style[col] = map[line->style[col]];
+            }
+        }
+    }
+    terminal.style_id = map[terminal.style_id];
+
+    if (count != terminal.styles.count) {
+        debug("%lu -> %lu styles", (unsigned long)terminal.styles.count, (unsigned long)count);
+        terminal.styles.count = count;
+        style_reindex();
+        grids_renumbered();
+    }
 }
 
-static void
-term_delete(size_t from, size_t to, size_t stop)
-/* Delete characters, i.e. move the following back and erase those at the end
- * from: cell index to start erasing (inclusive)
- * to  : cell index to end erasing (inclusive)
- * stop: cell index of last character to move (inclusive)
- * Arguments are cell indexes */
+/* }}} */
+
+/* Colors {{{ */
+
+static inline color_t
+term_color(color_index_t color, color_t default_color)
 {
-    if (from > to || to > stop) {
-        term_align(&from, &to, &stop);
+    if (color == COLOR_DEFAULT) {
+        return default_color;
     }
+    if (color < COLOR_TRUECOLOR) {
+        return config.color[color - COLOR_PALETTE];
+    }
+    return terminal.truecolor.color[color - COLOR_TRUECOLOR];
+}
 
-    struct glyph_t *start;
-    size_t to_delete = to - from + 1;
-    size_t to_move   = stop - to;
-
-    start = terminal.text + from;
+static inline uint32_t
+truecolor_hash(color_t rgb)
+{
+    return rgb * 2654435761u;
+}
 
-    memmove(start, start + to_delete, to_move * sizeof(*start));
-    term_erase(from + to_move, stop);
+static void
+truecolor_index_add(size_t pos)
+{
+    uint32_t mask = terminal.truecolor.index_size - 1;
+    size_t i;
 
-    term_invalidate_range(from, stop);
+    i = truecolor_hash(terminal.truecolor.color[pos]) & mask;
+    while (terminal.truecolor.index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    terminal.truecolor.index[i] = pos + 1;
 }
 
 static void
-term_insert(size_t from, size_t num, size_t stop)
-/* Insert num blank cells starting at from and push the following forward,
-   no longer than to stop
- */
+truecolor_reindex()
 {
-    if (from > stop) {
-        term_align(&from, &stop, NULL);
+    size_t pos;
+
+    while (terminal.truecolor.index_size < 2 * terminal.truecolor.size) {
+        terminal.truecolor.index_size = max(terminal.truecolor.index_size * 2, 64);
     }
+    terminal.truecolor.index = erealloc(terminal.truecolor.index,
+            terminal.truecolor.index_size * sizeof(*terminal.truecolor.index));
+    memset(terminal.truecolor.index, 0,
+            terminal.truecolor.index_size * sizeof(*terminal.truecolor.index));
 
-    struct glyph_t *start;
+    for (pos = 0; pos < terminal.truecolor.count; pos++) {
+        truecolor_index_add(pos);
+    }
+}
 
-    num = min(num, stop - from);
-    start = terminal.text + from;
+static color_index_t
+truecolor_cube(color_t rgb)
+/* Nearest color in the 6x6x6 cube of the 256 color palette */
+{
+    uint32_t i, v, cube = 0;
 
-    memmove(start + num, start, (stop + 1 - (from + num)) * sizeof(*start));
-    term_erase(from, from + num - 1);
+    for (i = 0; i < 3; i++) {
+        v = (rgb >> (16 - 8 * i)) & 0xff;
+        cube = cube * 6 + (v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40);
+    }
+    return COLOR_PALETTE + 16 + cube;
+}
 
-    term_invalidate_range(from, stop);
+static color_index_t
+truecolor_intern(color_t rgb)
+/* Return the index of an RGB color, adding it if new */
+{
+    uint32_t mask;
+    size_t i, pos;
+
+    if (terminal.truecolor.index_size > 0) {
+        mask = terminal.truecolor.index_size - 1;
+        for (i = truecolor_hash(rgb) & mask;
+             terminal.truecolor.index[i] != 0;
+             i = (i + 1) & mask) {
+            pos = terminal.truecolor.index[i] - 1;
+            if (terminal.truecolor.color[pos] == rgb) {
+                return COLOR_TRUECOLOR + pos;
+            }
+        }
+    }
+
+    if (terminal.truecolor.count >= COLORS_MAX - COLOR_TRUECOLOR) {
+        return truecolor_cube(rgb); /* Wait for term_gc() */
+    }
+
+    pos = terminal.truecolor.count++;
+    if (pos >= terminal.truecolor.size) {
+        terminal.truecolor.size = max(terminal.truecolor.size * 2, 32);
+        terminal.truecolor.color = erealloc(terminal.truecolor.color,
+                terminal.truecolor.size * sizeof(*terminal.truecolor.color));
+    }
+    terminal.truecolor.color[pos] = rgb;
+
+    if (terminal.truecolor.index_size < 2 * terminal.truecolor.size) {
+        truecolor_reindex();
+    }
+    else {
+        truecolor_index_add(pos);
+    }
+    return COLOR_TRUECOLOR + pos;
 }
 
 static void
-term_newline(bool carriage_return)
+truecolor_gc()
+/* Drop RGB colors no longer in use, and renumber the rest */
 {
-    size_t bottom = terminal.margin.bottom;
+    size_t i, pos, count;
+    color_index_t *map;
+    struct style_t *st;
+
+    if (terminal.truecolor.count == 0) {
+        return;
+    }
+
+    map = arena_alloc(&terminal.arena, terminal.truecolor.count * sizeof(*map));
+    memset(map, 0, terminal.truecolor.count * sizeof(*map));
+
+    /* Colors are only referred to by styles */
+#define MARK(color) do { if ((color) >= COLOR_TRUECOLOR) \
+                             map[(color) - COLOR_TRUECOLOR] = 1; } while (0)
+    for (i = 0, st = terminal.styles.style; i < terminal.styles.count; i++, st++) {
+        MARK(st->foreground);
+        MARK(st->background);
+    }
+    MARK(terminal.style.foreground);
+    MARK(terminal.style.background);
+    MARK(terminal.saved_cur.style.foreground);
+    MARK(terminal.saved_cur.style.background);
+    MARK(terminal.inactive_saved_cur.style.foreground);
+    MARK(terminal.inactive_saved_cur.style.background);
+#undef MARK
+
+    for (pos = count = 0; pos < terminal.truecolor.count; pos++) {
+        if (map[pos]) {
+            terminal.truecolor.color[count] = terminal.truecolor.color[pos];
+            map[pos] = COLOR_TRUECOLOR + count++;
+        }
+    }
+
+#define REMAP(color) do { if ((color) >= COLOR_TRUECOLOR) \
+                              (color) = map[(color) - COLOR_TRUECOLOR]; } while (0)
+    for (i = 0, st = terminal.styles.style; i < terminal.styles.count; i++, st++) {
+        REMAP(st->foreground);
+        REMAP(st->background);
+    }
+    REMAP(terminal.style.foreground);
+    REMAP(terminal.style.background);
+    REMAP(terminal.saved_cur.style.foreground);
+    REMAP(terminal.saved_cur.style.background);
+    REMAP(terminal.inactive_saved_cur.style.foreground);
+    REMAP(terminal.inactive_saved_cur.style.background);
+#undef REMAP
+
+    if (count != terminal.truecolor.count) {
+        debug("%lu -> %lu colors", (unsigned long)terminal.truecolor.count, (unsigned long)count);
+        terminal.truecolor.count = count;
+        truecolor_reindex();
+        style_reindex(); /* Hashes changed with the colors */
+    }
+}
+
+/* }}} */
+
+/* Combining characters {{{ */
+
+static uint32_t
+cluster_hash(const wchar_t *c, size_t length)
+{
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (uint32_t)c[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void
+cluster_index_add(uint32_t id)
+{
+    struct cluster_t *cl = &terminal.clusters.cluster[id];
+    uint32_t mask = terminal.clusters.index_size - 1;
+    size_t i;
+
+    i = cluster_hash(cl->c, cl->length) & mask;
+    while (terminal.clusters.index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    terminal.clusters.index[i] = id;
+}
+
+static void
+cluster_reindex()
+{
+    size_t id;
+
+    while (terminal.clusters.index_size < 2 * terminal.clusters.size) {
+        terminal.clusters.index_size = max(terminal.clusters.index_size * 2, 64);
+    }
+    terminal.clusters.index = erealloc(terminal.clusters.index,
+            terminal.clusters.index_size * sizeof(*terminal.clusters.index));
+    memset(terminal.clusters.index, 0,
+            terminal.clusters.index_size * sizeof(*terminal.clusters.index));
+
+    for (id = 1; id < terminal.clusters.count; id++) {
+        cluster_index_add(id);
+    }
+}
+
+static wchar_t
+cluster_intern(const wchar_t *c, size_t length)
+/* Return the id of the cluster, adding it if new. Returns '\0' if full. */
+{
+    uint32_t mask, id;
+    size_t i;
+
+    if (terminal.clusters.index_size > 0) {
+        mask = terminal.clusters.index_size - 1;
+        for (i = cluster_hash(c, length) & mask;
+             (id = terminal.clusters.index[i]) != 0;
+             i = (i + 1) & mask) {
+            struct cluster_t *cl = &terminal.clusters.cluster[id];
+            if (cl->length == length &&
+                    memcmp(cl->c, c, length * sizeof(*c)) == 0) {
+                return id;
+            }
+        }
+    }
+
+    if (terminal.clusters.count >= CLUSTERS_MAX) {
+        return '\0'; /* Wait for term_gc() */
+    }
+
+    id = max(terminal.clusters.count, 1);
+    if (id >= terminal.clusters.size) {
+        terminal.clusters.size = max(terminal.clusters.size * 2, 32);
+        terminal.clusters.cluster = erealloc(terminal.clusters.cluster,
+                terminal.clusters.size * sizeof(*terminal.clusters.cluster));
+    }
+
+    memcpy(terminal.clusters.cluster[id].c, c, length * sizeof(*c));
+    terminal.clusters.cluster[id].length = length;
+    terminal.clusters.count = id + 1;
+
+    if (terminal.clusters.index_size < 2 * terminal.clusters.size) {
+        cluster_reindex();
+    }
+    else {
+        cluster_index_add(id);
+    }
+    return id;
+}
+
+static inline wchar_t *
+cluster_get(wchar_t id, size_t *length)
+{
+    assert(id > 0 && (size_t)id < terminal.clusters.count);
+
+    *length = terminal.clusters.cluster[id].length;
+    return terminal.clusters.cluster[id].c;
+}
+
+static void
+cluster_clear()
+{
+    terminal.clusters.count = 1;
+    if (terminal.clusters.index != NULL) {
+        memset(terminal.clusters.index, 0,
+                terminal.clusters.index_size * sizeof(*terminal.clusters.index));
+    }
+}
+
+static void
+cluster_gc()
+/* Drop clusters no longer on either screen, and renumber the rest */
+{
+    size_t row, col, g, id, count;
+    wchar_t *map;
+    struct line_t *line;
+    struct grid_t *grids[] = {&terminal.grid, &terminal.inactive};
+
+    if (terminal.clusters.count <= 1) {
+        return;
+    }
+
+    map = arena_alloc(&terminal.arena, terminal.clusters.count * sizeof(*map));
+    memset(map, 0, terminal.clusters.count * sizeof(*map));
+
+    for (g = 0; g < LENGTH(grids) && grids[g]->line != NULL; g++) {
+        for (row = 0, line = grids[g]->line; row < terminal.rows; row++, line++) {
+            for (col = 0; col < terminal.cols && !line->blank; col++) {
+                if (style_get(line->style[col]).attr & CHAR_ATTR_COMBINED) {
+                    map[line->text[col]] = 1;
+                }
+            }
+        }
+    }
+
+    for (id = count = 1; id < terminal.clusters.count; id++) {
+        if (map[id]) {
+            terminal.clusters.cluster[count] = terminal.clusters.cluster[id];
+            map[id] = count++;
+        }
+    }
+
+    for (g = 0; g < LENGTH(grids) && grids[g]->line != NULL; g++) {
+        for (row = 0, line = grids[g]->line; row < terminal.rows; row++, line++) {
+            for (col = 0; col < terminal.cols && !line->blank; col++) {
+                if (style_get(line->style[col]).attr & CHAR_ATTR_COMBINED) {
+                    line->text[col] = map[line->text[col]];
+                }
+            }
+        }
+    }
+
+    if (count != terminal.clusters.count) {
+        debug("%lu -> %lu clusters", (unsigned long)terminal.clusters.count, (unsigned long)count);
+        terminal.clusters.count = count;
+        cluster_reindex();
+        grids_renumbered();
+    }
+}
+
+/* }}} */
+
+static void
+term_rehash()
+/* Hash the rows that were left unhashed, here and on screen, so that
+ * rewriting them as they are is caught by term_front_diff */
+{
+    size_t row;
+
+    for (row = 0; row < terminal.rows; row++) {
+        if (!terminal.grid.line[row].blank && !terminal.grid.line[row].hashed) {
+            line_rehash(terminal.grid.line + row);
+        }
+        if (!terminal.front.line[row].blank && !terminal.front.line[row].hashed) {
+            line_rehash(terminal.front.line + row);
+        }
+    }
+}
+
+void
+term_gc()
+/* Set terminal in an optimal state. Not nescessary, but may improve
+ * performance later
+ */
+{
+    style_gc();
+    cluster_gc();
+    truecolor_gc();
+    term_rehash();
+}
+
+static void
+term_cursor(size_t x, size_t y)
+{
+    terminal.x = min(x, EOL);
+    terminal.y = min(y + terminal.page.top, terminal.page.bottom);
+
+    terminal.wrap_next = false;
+    terminal.cursor_dirty = true;
+}
+
+
+
+static void
+term_set(size_t from, size_t to, wchar_t c, style_id_t style)
+/* Set cells from..to (inclusive) to c in style, a line at a time */
+{
+    size_t row, first, last;
+    struct line_t *line;
+
+    for (row = from / terminal.cols; row <= to / terminal.cols; row++) {
+        line  = terminal.grid.line + row;
+        first = (row == from / terminal.cols) ? from % terminal.cols : BOL;
+        last  = (row == to   / terminal.cols) ? to   % terminal.cols : EOL;
+
+        if (c == '\0' && first == BOL && last == EOL) {
+            line->blink = 0;
+            line->blank = true;
+            line->blank_style = style;
+            continue;
+        }
+        line_materialize(line, terminal.cols);
+        if (style_get(style).attr & CHAR_ATTR_BLINK) {
+            line->blink += last - first + 1;
+        }
+
+        kernels.fill_text(line->text + first, c, last - first + 1);
+        kernels.fill_style(line->style + first, style, last - first + 1);
+        line->hashed = false;
+    }
+}
+
+static void
+term_move(size_t dst, size_t src, size_t n)
+/* Move n cells from cell index src to dst. The ranges may overlap, and
+ * span lines */
+{
+    size_t chunk, cols = terminal.cols;
+
+    if (dst < src) {
+        while (n > 0) {
+            chunk = min(n, min(cols - dst % cols, cols - src % cols));
+            memmove(TEXT(dst), TEXT(src), chunk * sizeof(wchar_t));
+            memmove(STYLE(dst), STYLE(src), chunk * sizeof(style_id_t));
+            LINE(dst)->hashed = false;
+            if (LINE(dst) != LINE(src)) {
+                LINE(dst)->blink += min(chunk, LINE(src)->blink);
+            }
+            dst += chunk;
+            src += chunk;
+            n   -= chunk;
+        }
+    }
+    else if (dst > src) {
+        /* Back to front */
+        while (n > 0) {
+            chunk = min(n, min((dst + n - 1) % cols, (src + n - 1) % cols) + 1);
+            n -= chunk;
+            memmove(TEXT(dst + n), TEXT(src + n), chunk * sizeof(wchar_t));
+            memmove(STYLE(dst + n), STYLE(src + n), chunk * sizeof(style_id_t));
+            LINE(dst + n)->hashed = false;
+            if (LINE(dst + n) != LINE(src + n)) {
+                LINE(dst + n)->blink += min(chunk, LINE(src + n)->blink);
+            }
+        }
+    }
+}
+
+static void
+term_reverse_lines(struct line_t *line, size_t n)
+{
+    struct line_t tmp;
+    size_t i;
+
+    for (i = 0; i < n / 2; i++) {
+        tmp = line[i];
+        line[i] = line[n - 1 - i];
+        line[n - 1 - i] = tmp;
+    }
+}
+
+static void
+term_rotate(struct line_t *line, size_t top, size_t bottom, size_t n)
+/* Rotate lines top..bottom (inclusive) up by n, so the line at top + n
+ * ends up at top, and the top n lines at the bottom. Only line pointers
+ * are moved */
+{
+    size_t height = bottom - top + 1;
+
+    line += top;
+
+    n %= height;
+    if (n == 0) {
+        return;
+    }
+
+    term_reverse_lines(line, n);
+    term_reverse_lines(line + n, height - n);
+    term_reverse_lines(line, height);
+}
+
+static void
+term_fill(size_t from, size_t to, wchar_t c)
+{
+    if (from > to) {
+        return;
+    }
+
+    term_set(from, to, c, terminal.style_id);
+
+    term_invalidate_range(from, to);
+}
+
+
+static void
+term_erase(size_t from, size_t to)
+{
+    style_id_t style = 0;
+
+    if (from > to) {
+        return;
+    }
+
+    /* Don't leave half of a double width glyph behind */
+    if (from % terminal.cols != BOL &&
+            *TEXT(from) == GLYPH_WIDE_TAIL) {
+        from -= 1;
+    }
+    if (to % terminal.cols != EOL &&
+            *TEXT(to + 1) == GLYPH_WIDE_TAIL) {
+        to += 1;
+    }
+
+    /* BCE - Background Color Erase */
+    if (config.bce) {
+        struct style_t erase = terminal.style;
+
+        erase.attr = CHAR_ATTR_NONE;
+        style = style_intern(erase);
+    }
+
+    term_set(from, to, '\0', style);
+
+    term_invalidate_range(from, to);
+}
+
+static void
+term_delete(size_t from, size_t to, size_t stop)
+/* Delete characters, i.e. move the following back and erase those at the end
+ * from: cell index to start erasing (inclusive)
+ * to  : cell index to end erasing (inclusive)
+ * stop: cell index of last character to move (inclusive)
+ * Arguments are cell indexes */
+{
+    if (from > to || to > stop) {
+        return;
+    }
+
+    size_t to_delete = to - from + 1;
+    size_t to_move   = stop - to;
+
+    term_move(from, from + to_delete, to_move);
+    term_erase(from + to_move, stop);
+
+    term_invalidate_range(from, stop);
+}
+
+static void
+term_insert(size_t from, size_t num, size_t stop)
+/* Insert num blank cells starting at from and push the following forward,
+   no longer than to stop
+ */
+{
+    if (from > stop) {
+        return;
+    }
+
+    num = min(num, stop - from);
+
+    term_move(from + num, from, stop + 1 - (from + num));
+    term_erase(from, from + num - 1);
+
+    term_invalidate_range(from, stop);
+}
+
+static void
+term_dirty_row_move(size_t dst, size_t src)
+/* Copy the dirty bit of row src to row dst */
+{
+    uint64_t *rows = terminal.dirty.rows;
+
+    rows[dst / 64] &= ~(1ULL << (dst % 64));
+    rows[dst / 64] |= ((rows[src / 64] >> (src % 64)) & 1) << (dst % 64);
+}
+
+static void
+term_scroll_damage(size_t top, size_t bottom, int lines)
+/* Lines top..bottom were scrolled. Move their damage along, and leave the
+ * rest to the renderer's scroll if it has one */
+{
+    size_t height = bottom - top + 1;
+    size_t n = abs(lines);
+    size_t row;
+
+    if (term_cb->scroll == NULL || n >= height ||
+        (terminal.scroll.lines != 0 &&
+         (terminal.scroll.top != top || terminal.scroll.bottom != bottom))) {
+        /* Only one region can be scrolled per flush */
+        term_invalidate_range(SCREEN(BOL, top), SCREEN(EOL, bottom));
+        return;
+    }
+
+    terminal.scroll.top = top;
+    terminal.scroll.bottom = bottom;
+    terminal.scroll.lines += lines;
+
+    if (lines > 0) {
+        memmove(DIRTY(top), DIRTY(top + n),
+                (height - n) * terminal.dirty.words * sizeof(uint64_t));
+        for (row = top; row + n <= bottom; row++) {
+            term_dirty_row_move(row, row + n);
+        }
+        top = bottom - n + 1;
+    }
+    else {
+        memmove(DIRTY(top + n), DIRTY(top),
+                (height - n) * terminal.dirty.words * sizeof(uint64_t));
+        for (row = bottom; row >= top + n; row--) {
+            term_dirty_row_move(row, row - n);
+        }
+        bottom = top + n - 1;
+    }
+    for (row = top; row <= bottom; row++) {
+        term_damage(row, BOL, EOL + 1);
+    }
+}
+
+static void
+term_scroll(size_t top, size_t bottom, int lines)
+/* Scroll lines top..bottom (inclusive) up by lines, or down if negative,
+ * and blank the lines scrolled in */
+{
+    size_t height = bottom - top + 1;
+    size_t n = min((size_t)abs(lines), height);
+
+    if (n == 0) {
+        return;
+    }
+
+    if (lines > 0) {
+        term_rotate(terminal.grid.line, top, bottom, n);
+        term_scroll_damage(top, bottom, n);
+        term_erase(SCREEN(BOL, bottom - n + 1), SCREEN(EOL, bottom));
+    }
+    else {
+        term_rotate(terminal.grid.line, top, bottom, height - n);
+        term_scroll_damage(top, bottom, -(int)n);
+        term_erase(SCREEN(BOL, top), SCREEN(EOL, top + n - 1));
+    }
+}
+
+static void
+term_newlines(const char *ahead)
+/* A line feed at the bottom margin. Count the line feeds that follow in
+ * ahead and will scroll too, and scroll for all of them at once. The text
+ * between them is still written by term_write, to the lines made here.
+ * Counting stops at anything that could move the cursor otherwise.
+ */
+{
+    size_t lines = 1, col, expect = 0;
+    size_t x = terminal.crlf ? BOL : X;
+    const unsigned char *p;
+
+    col = x;
+    for (p = (const unsigned char *)ahead;
+         *p != '\0' && lines < terminal.margin.height;
+         p++) {
+        if (*p == '\n' || *p == '\v' || *p == '\f') {
+            lines++;
+            if (terminal.crlf) {
+                col = BOL;
+            }
+        }
+        else if (*p == '\r') {
+            col = BOL;
+        }
+        else if (*p < 0x20 || *p == 0x7f) {
+            break;
+        }
+        else if (*p < 0x80) {
+            col += 1;
+        }
+        else if (*p < 0xc0) {
+            /* Unless part of a character, this is a C1 control */
+            if (expect == 0) {
+                break;
+            }
+            expect -= 1;
+        }
+        else {
+            /* Characters of three bytes or more may be double width */
+            expect = (*p >= 0xf0) ? 3 : (*p >= 0xe0) ? 2 : 1;
+            col += (*p >= 0xe0) ? 2 : 1;
+        }
+
+        if (col > terminal.cols) {
+            break; /* Might wrap, and scroll once more */
+        }
+    }
+
+    term_scroll(terminal.margin.top, terminal.margin.bottom, lines);
+    term_cursor(x, terminal.margin.bottom - (lines - 1) - terminal.page.top);
+}
+
+static void
+term_newline(bool carriage_return)
+{
+    size_t bottom = terminal.margin.bottom;
+    size_t x = carriage_return ? BOL : X;
+
+    if (terminal.y == bottom) {
+        /* The cursor stays on the bottom margin */
+        term_scroll(terminal.margin.top, bottom, 1);
+        term_cursor(x, Y);
+    }
+    else {
+        term_cursor(x, Y + 1);
+    }
+}
+
+
+void
+term_invalidate()
+/* Repaint everything. The screen may not show what was last painted */
+{
+    size_t row;
+
+    if (terminal.rows > 0) {
+        for (row = 0; row < terminal.rows; row++) {
+            front_forget(row, BOL, EOL + 1);
+        }
+        term_invalidate_range(SCREEN(BOL, TOP), SCREEN(EOL, BOTTOM));
+    }
+}
+
+static void
+front_forget(size_t row, size_t left, size_t right)
+/* Cells left..right (exclusive) of row may not show what the front grid
+ * says, e.g. because they blinked. Damaged cells there are painted even
+ * if unchanged */
+{
+    struct line_t *line = terminal.front.line + row;
+
+    if (left == BOL && right == EOL + 1) {
+        line->blank = true;
+        line->blank_style = STYLE_UNKNOWN;
+        return;
+    }
+    line_materialize(line, terminal.cols);
+    kernels.fill_style(line->style + left, STYLE_UNKNOWN, right - left);
+    line->hashed = false;
+}
+
+static void
+term_invalidate_range(size_t start, size_t end)
+{
+    size_t xstart, ystart, xend, yend;
+
+    if (start > end) {
+        return;
+    }
+
+    xstart = start % terminal.cols;
+    xend   = end   % terminal.cols;
+
+    ystart = start / terminal.cols;
+    yend   = end   / terminal.cols;
+
+    assert(ystart < terminal.rows);
+    assert(yend < terminal.rows);
+
+    if (ystart == yend) {
+        term_damage(ystart, xstart, xend + 1);
+        return;
+    }
+
+    term_damage(ystart, xstart, EOL + 1);
+    term_damage(yend, BOL, xend + 1);
+
+    /* Whole rows in between. Bits past the last column are never read */
+    memset(DIRTY(ystart + 1), 0xff,
+           (yend - ystart - 1) * terminal.dirty.words * sizeof(uint64_t));
+    bits_set(terminal.dirty.rows, ystart + 1, yend);
+}
+
+static void
+term_invalidate_diff(struct grid_t *shown)
+/* Mark the cells where the grid differs from shown, the grid that was on
+ * screen. Everything else on screen is already right.
+ */
+{
+    size_t row, left, right;
+    const wchar_t *text, *shown_text;
+    const style_id_t *style, *shown_style;
+
+    for (row = 0; row < terminal.rows; row ++) {
+        if (terminal.grid.line[row].blank && shown->line[row].blank) {
+            if (terminal.grid.line[row].blank_style != shown->line[row].blank_style) {
+                term_damage(row, BOL, EOL + 1);
+            }
+            continue;
+        }
+        line_materialize(terminal.grid.line + row, terminal.cols);
+        line_materialize(shown->line + row, terminal.cols);
+
+        text        = terminal.grid.line[row].text;
+        style       = terminal.grid.line[row].style;
+        shown_text  = shown->line[row].text;
+        shown_style = shown->line[row].style;
+
+        for (left = 0; left < terminal.cols; left ++) {
+            if (text[left] != shown_text[left] || style[left] != shown_style[left])
+                break;
+        }
+        if (left == terminal.cols) {
+            continue;
+        }
+        for (right = terminal.cols; right > left + 1; right --) {
+            if (text[right - 1] != shown_text[right - 1] || style[right - 1] != shown_style[right - 1])
+                break;
+        }
+
+        term_damage(row, left, right);
+    }
+}
+
+static void
+term_invalidate_blinkers()
+/* Mark blinking cells dirty, and count them again on the way. Styles are
+ * looked up once per run of cells in the same style */
+{
+    size_t row, col, run;
+    struct line_t *line;
+
+    for (row = 0; row < terminal.rows; row ++) {
+        line = terminal.grid.line + row;
+        if (line->blink == 0) {
+            continue;
+        }
+        line->blink = 0;
+        for (col = 0; col < terminal.cols && !line->blank; col = run) {
+            run = col + kernels.style_run(line->style + col, terminal.cols - col);
+            if (style_get(line->style[col]).attr & CHAR_ATTR_BLINK) {
+                term_damage(row, col, run);
+                front_forget(row, col, run);
+                line->blink += run - col;
+            }
+        }
+    }
+}
+
+static bool
+term_blinking()
+/* Is there anything that blinks on screen? */
+{
+    size_t row;
+
+    if (terminal.show_cursor && terminal.blink_cursor) {
+        return true;
+    }
+    for (row = 0; row < terminal.rows; row ++) {
+        if (terminal.grid.line[row].blink > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+/* How a cell is painted, once attributes and reverse video are applied */
+struct paint_t {
+    bool            clear; /* Only the background is painted, in bg */
+    color_t         fg, bg;
+    bool            bold, underline;
+};
+
+/* Neighbouring cells that are painted alike, gathered to go out in one
+ * call. See paint_run_add */
+struct paint_run_t {
+    size_t          col, cells;
+    struct paint_t  paint;
+    bool            blank; /* All cells are '\0' */
+};
+
+static inline struct paint_t
+term_paint(struct style_t style, bool blank)
+/* How cells in style are painted. Blank cells show only a background */
+{
+    color_t fg = term_color(style.foreground, config.foreground);
+    color_t bg = term_color(style.background, config.background);
+    char_attr_t attr = style.attr;
+    struct paint_t paint = {
+        .clear = true,
+        .bold = attr & CHAR_ATTR_BOLD,
+        .underline = attr & CHAR_ATTR_UNDERLINE,
+    };
+
+    if (blank) {
+        bool reverse = terminal.reverse_vid ^ (bool)(attr & CHAR_ATTR_INVERSE);
+        if (config.bce) {
+            paint.bg = reverse ? fg : bg;
+        }
+        else {
+            paint.bg = reverse ? config.foreground : config.background;
+        }
+    }
+    else if ((attr & CHAR_ATTR_INVISIBLE) ||
+            ((attr & CHAR_ATTR_BLINK) && terminal.blinked)) {
+        paint.bg = terminal.reverse_vid ? fg : bg;
+    }
+    else {
+        if (attr & CHAR_ATTR_INVERSE) {
+            color_t tmp = fg;
+            fg = bg;
+            bg = tmp;
+        }
+
+        if (terminal.reverse_vid) {
+            color_t tmp = fg;
+            fg = bg;
+            bg = tmp;
+        }
+
+        paint.clear = false;
+        paint.fg = fg;
+        paint.bg = bg;
+    }
+    return paint;
+}
+
+static void
+term_draw(const struct draw_run_t *run)
+/* Pass run on to the callbacks, or gather it into the frame when they
+ * take a draw list */
+{
+    struct draw_frame_t *frame = &terminal.list.frame;
+
+    if (run->row == terminal.cursor_painted.y &&
+        between(terminal.cursor_painted.x, run->col, run->col + run->cells - 1)) {
+        terminal.list.cursor_covered = true;
+    }
+
+    if (term_cb->draw_list != NULL) {
+        if (terminal.list.cursor) {
+            frame->cursor = *run;
+            frame->show_cursor = true;
+            return;
+        }
+        if (frame->runs == terminal.list.size) {
+            terminal.list.size = max(64, terminal.list.size * 2);
+            frame->run = erealloc(frame->run,
+                                  terminal.list.size * sizeof(*frame->run));
+        }
+        frame->run[frame->runs++] = *run;
+        return;
+    }
+
+    if (run->text == NULL || run->wide) {
+        (*term_cb->clear_line)(run->col, run->row, run->cells, run->bg);
+    }
+    if (run->text == NULL) {
+        return;
+    }
+    if (run->cluster && term_cb->write_cluster != NULL) {
+        (*term_cb->write_cluster)(run->col, run->row, run->text, run->length,
+                                  run->fg, run->bg, run->bold, run->underline);
+    }
+    else { /* Of a cluster, the base character only */
+        (*term_cb->write_screen)(run->col, run->row, run->text,
+                                 run->cluster ? 1 : run->length,
+                                 run->fg, run->bg, run->bold, run->underline);
+    }
+}
+
+static inline void
+term_draw_fill(size_t col, size_t row, size_t cells, color_t bg)
+{
+    struct draw_run_t run = {
+        .col = col, .row = row, .cells = cells, .bg = bg,
+    };
+
+    term_draw(&run);
+}
+
+static inline void
+term_draw_text(size_t col, size_t row, size_t cells,
+               wchar_t *text, size_t length, struct paint_t paint, bool cluster)
+{
+    struct draw_run_t run = {
+        .col = col, .row = row, .cells = cells,
+        .text = text, .length = length,
+        .fg = paint.fg, .bg = paint.bg,
+        .bold = paint.bold, .underline = paint.underline,
+        .cluster = cluster,
+        .wide = cells != (cluster ? 1 : length),
+    };
+
+    term_draw(&run);
+}
+
+static void
+term_flush_section(size_t col, size_t row, wchar_t *text, size_t length, size_t cells, struct style_t style)
+/* Paint length characters covering cells cells. These differ only when
+ * a double width glyph is painted */
+{
+    struct paint_t paint = term_paint(style, *text == '\0');
+
+    if (paint.clear) {
+        term_draw_fill(col, row, cells, paint.bg);
+        return;
+    }
+
+    if (style.attr & CHAR_ATTR_COMBINED) {
+        /* Each cell is painted with all its combining characters */
+        size_t i, n;
+        wchar_t *cluster;
+
+        for (i = 0; i < length; i++) {
+            cluster = cluster_get(text[i], &n);
+            term_draw_text(col + i, row, length == 1 ? cells : 1,
+                           cluster, n, paint, true);
+        }
+        return;
+    }
+
+    term_draw_text(col, row, cells, text, length, paint, false);
+}
+
+static inline void
+paint_run_flush(struct paint_run_t *run, size_t row, wchar_t *text)
+/* Paint the cells gathered in run, text being the row they are on */
+{
+    if (run->cells == 0) {
+        return;
+    }
+    if (run->paint.clear) {
+        term_draw_fill(run->col, row, run->cells, run->paint.bg);
+    }
+    else {
+        term_draw_text(run->col, row, run->cells, text + run->col, run->cells,
+                       run->paint, false);
+    }
+    run->cells = 0;
+}
+
+static inline void
+paint_run_add(struct paint_run_t *run, size_t row, wchar_t *text,
+              size_t col, size_t cells, struct paint_t paint, bool blank)
+/* Add cells col.. to run, painting what run held first unless they go
+ * together. Clears in the same color go together, and so does text in the
+ * same colors and font. Blank cells also join text on the same background,
+ * as write_screen shows '\0' as a space, unless it would underline them */
+{
+    if (run->cells > 0 && run->col + run->cells == col) {
+        if (run->paint.clear == paint.clear && run->paint.bg == paint.bg &&
+            (paint.clear || (run->paint.fg == paint.fg &&
+                             run->paint.bold == paint.bold &&
+                             run->paint.underline == paint.underline))) {
+            run->cells += cells;
+            run->blank &= blank;
+            return;
+        }
+        if (!run->paint.clear && blank &&
+            run->paint.bg == paint.bg && !run->paint.underline) {
+            run->cells += cells; /* An erased tail */
+            return;
+        }
+        if (run->paint.clear && run->blank && !paint.clear &&
+            run->paint.bg == paint.bg && !paint.underline) {
+            run->paint = paint; /* Blanks leading up to text */
+            run->cells += cells;
+            return;
+        }
+    }
+
+    paint_run_flush(run, row, text);
+    run->col   = col;
+    run->cells = cells;
+    run->paint = paint;
+    run->blank = blank;
+}
+
+static void
+term_flush_glyph(size_t col, size_t row, bool cursor)
+/* Paint the glyph covering cell (col, row), inverted if it is the cursor.
+ * A double width glyph is painted whole, whichever half is addressed.
+ */
+{
+    static wchar_t blank = '\0'; /* Outlives the call, for draw_list */
+    struct line_t *line = terminal.grid.line + row;
+    wchar_t *text = line->text;
+    size_t i = col;
+    size_t cells = 1;
+    struct style_t style;
+    wchar_t *c = &blank;
+
+    if (line->blank) {
+        style = style_get(line->blank_style);
+    }
+    else {
+        if (text[i] == GLYPH_WIDE_TAIL && col > BOL && text[i - 1] != GLYPH_WIDE_TAIL) {
+            col -= 1;
+            i -= 1;
+        }
+        if (col < EOL && text[i + 1] == GLYPH_WIDE_TAIL && text[i] != GLYPH_WIDE_TAIL) {
+            cells = 2;
+        }
+
+        if (text[i] != GLYPH_WIDE_TAIL) {
+            c = text + i;
+        }
+        style = style_get(line->style[i]);
+    }
+    if (cursor) {
+        style.foreground = COLOR_DEFAULT;
+        style.background = COLOR_DEFAULT;
+        style.attr ^= CHAR_ATTR_INVERSE;
+    }
+    term_flush_section(col, row, c, 1, cells, style);
+}
+
+static void
+term_flush_cursor()
+{
+    /* Unless its row painted it already, the old cursor cell is repainted
+     * as it is. Runs in a frame don't overlap */
+    if (!terminal.list.cursor_covered) {
+        term_flush_glyph(terminal.cursor_painted.x, terminal.cursor_painted.y, false);
+    }
+
+    terminal.cursor_painted.x = X;
+    terminal.cursor_painted.y = terminal.y;
+    terminal.cursor_dirty = false;
+
+    if (terminal.show_cursor && (!terminal.blink_cursor || !terminal.blinked)) {
+        terminal.list.cursor = true;
+        term_flush_glyph(X, terminal.y, true);
+        terminal.list.cursor = false;
+    }
+}
+
+static bool /* Return true if we scrolled */
+term_flush_scroll()
+{
+    size_t top = terminal.scroll.top, bottom = terminal.scroll.bottom;
+    int lines = terminal.scroll.lines;
+    size_t n = abs(lines), row;
+    int y;
+
+    terminal.scroll.lines = 0;
+    if (lines == 0 || (size_t)abs(lines) > bottom - top) {
+        return false; /* Nothing left to reuse, it is all damaged */
+    }
+
+    if (term_cb->draw_list != NULL) {
+        terminal.list.frame.scroll.top = top;
+        terminal.list.frame.scroll.bottom = bottom;
+        terminal.list.frame.scroll.lines = lines;
+    }
+    else {
+        (*term_cb->scroll)(top, bottom, lines);
+    }
+
+    /* The front grid moves along. Rows scrolled in show who knows what */
+    if (lines > 0) {
+        term_rotate(terminal.front.line, top, bottom, n);
+        top = bottom - n + 1;
+    }
+    else {
+        term_rotate(terminal.front.line, top, bottom, bottom - top + 1 - n);
+        bottom = top + n - 1;
+    }
+    for (row = top; row <= bottom; row++) {
+        front_forget(row, BOL, EOL + 1);
+    }
+
+    /* The cursor was moved along with the text */
+    top = terminal.scroll.top;
+    bottom = terminal.scroll.bottom;
+    y = (int)terminal.cursor_painted.y - lines;
+    if (between(terminal.cursor_painted.y, top, bottom) && between(y, top, bottom)) {
+        term_invalidate_range(SCREEN(terminal.cursor_painted.x, y),
+                              SCREEN(terminal.cursor_painted.x, y));
+        front_forget(y, terminal.cursor_painted.x, terminal.cursor_painted.x + 1);
+    }
+    return true;
+}
+
+static bool /* Return true if any dirty cell is left */
+term_front_diff(size_t row)
+/* Clear the dirty bits of cells of row that already show what they hold */
+{
+    static const wchar_t nul[64];
+    style_id_t blank[64];
+    struct line_t *line = terminal.grid.line + row;
+    struct line_t *shown = terminal.front.line + row;
+    uint64_t *dirty = DIRTY(row);
+    uint64_t left = 0, hash, shown_hash;
+    size_t w, col;
+
+    if (shown->blank) {
+        if (shown->blank_style == STYLE_UNKNOWN) {
+            return true;
+        }
+        if (line->blank && line->blank_style == shown->blank_style) {
+            memset(dirty, 0, terminal.dirty.words * sizeof(*dirty));
+            return false;
+        }
+    }
+
+    /* Rows written over with what they held are caught here, without
+     * looking at the cells */
+    if (line_hash(line, &hash) && line_hash(shown, &shown_hash) && hash == shown_hash) {
+        memset(dirty, 0, terminal.dirty.words * sizeof(*dirty));
+        return false;
+    }
+
+    if (shown->blank) {
+        line_materialize(shown, terminal.cols);
+    }
+    if (line->blank) {
+        kernels.fill_style(blank, line->blank_style, LENGTH(blank));
+    }
 
-    if (terminal.y >= bottom) {
-        terminal.ring_top += 1;
-        if (terminal.ring_top >= terminal.margin.height) {
-            terminal.ring_top = 0;
+    for (w = 0, col = 0; col < terminal.cols; w++, col += 64) {
+        if (dirty[w] == 0) {
+            continue;
         }
-        term_erase(PAGE(BOL,BOTTOM), PAGE(EOL,BOTTOM));
-        term_invalidate();
+        dirty[w] &= kernels.cells_differ(line->blank ? nul : line->text + col,
+                                         line->blank ? blank : line->style + col,
+                                         shown->text + col,
+                                         shown->style + col,
+                                         min(64, terminal.cols - col));
+        left |= dirty[w];
     }
 
-    size_t x = carriage_return ? BOL : X;
-    term_cursor(x, Y + 1);
-}
-
-
-void
-term_invalidate()
-{
-    size_t i;
-    for (i = 0; i < terminal.rows; i ++) {
-        terminal.dirty[i].left  = BOL;
-        terminal.dirty[i].right = EOL + 1;
+    if (left == 0 && !line->blank) {
+        /* The same cells, so the same hash */
+        line->hash = shown->hash;
+        line->hashed = shown->hashed;
     }
+    return left != 0;
 }
 
-static void
-term_invalidate_range(size_t start, size_t end)
+static bool /* Return true if anything was painted */
+term_flushline(size_t row)
+/* Paint the dirty cells of row that differ from what is on screen */
 {
-    size_t y;
-    size_t xstart, ystart, xend, yend;
-
-
-    if (start > end) {
-        term_align(&start, &end, NULL);
+    static wchar_t blank = '\0';
+    struct line_t *line = terminal.grid.line + row;
+    struct line_t *shown = terminal.front.line + row;
+    uint64_t *dirty = DIRTY(row);
+    size_t col, run, next, col_start, col_stop;
+    wchar_t *text = line->text;
+    style_id_t *style = line->style;
+    struct paint_run_t pending = { .cells = 0 };
+    struct paint_t ink;
+    struct style_t st;
+
+    if (!term_front_diff(row)) {
+        return false;
     }
-    assert(start <= end);
 
-    xstart = start % terminal.cols;
-    xend   = end   % terminal.cols;
+    col_stop = BOL;
+    while ((col_start = bits_next(dirty, col_stop, terminal.cols, true)) < terminal.cols) {
+        col_stop = bits_next(dirty, col_start, terminal.cols, false);
 
-    ystart = start / terminal.cols;
-    yend   = end   / terminal.cols;
+        if (line->blank) {
+            term_flush_section(col_start, row, &blank, 1, col_stop - col_start,
+                               style_get(line->blank_style));
+            continue;
+        }
 
-    assert(ystart < terminal.rows);
-    assert(yend < terminal.rows);
+        /* Widen to whole double width glyphs */
+        if (col_start > BOL && text[col_start] == GLYPH_WIDE_TAIL) {
+            col_start -= 1;
+        }
+        if (col_stop <= EOL && text[col_stop] == GLYPH_WIDE_TAIL) {
+            col_stop += 1;
+        }
 
-    for (y = ystart; y <= yend; y++) {
-        terminal.dirty[y].left  = min((y == ystart ? xstart : BOL), terminal.dirty[y].left);
-        terminal.dirty[y].right = max((y == yend   ? xend   : EOL) + 1, terminal.dirty[y].right);
-    }
-}
+        /* Runs are passed straight from the grid, and joined with their
+         * neighbours where they are painted alike */
+        col = col_start;
+        while (col < col_stop) {
+            run = col + kernels.style_run(style + col, col_stop - col);
+            st   = style_get(style[col]);
+            ink  = term_paint(st, false);
+
+            /* Split the style run where text turns to or from blanks, and
+             * around double width glyphs */
+            while (col < run) {
+                if (text[col] == GLYPH_WIDE_TAIL) {
+                    /* A tail without its leading half is left blank */
+                    paint_run_add(&pending, row, text, col, 1, term_paint(st, true), false);
+                    col += 1;
+                    continue;
+                }
+                if (col < EOL && text[col + 1] == GLYPH_WIDE_TAIL) {
+                    /* Painted once, from the leading cell */
+                    paint_run_flush(&pending, row, text);
+                    term_flush_section(col, row, text + col, 1, 2, st);
+                    col += 2;
+                    continue;
+                }
 
-static void
-term_invalidate_blinkers() {
-    size_t row, col;
-    struct glyph_t *g;
+                for (next = col + 1;
+                     next < run &&
+                     (text[next] == '\0') == (text[col] == '\0') &&
+                     text[next] != GLYPH_WIDE_TAIL &&
+                     (next == EOL || text[next + 1] != GLYPH_WIDE_TAIL);
+                     next ++);
 
-    for (row = 0; row < terminal.rows; row ++) {
-        g = terminal.text + SCREEN(BOL, row);
-        for (col = 0; col < terminal.cols; col ++, g++) {
-            if (g->attr & CHAR_ATTR_BLINK) {
-                terminal.dirty[row].left  = min(terminal.dirty[row].left, col);
-                terminal.dirty[row].right = max(terminal.dirty[row].right, col + 1);
+                if (text[col] == '\0') {
+                    paint_run_add(&pending, row, text, col, next - col, term_paint(st, true), true);
+                }
+                else if (st.attr & CHAR_ATTR_COMBINED) {
+                    paint_run_flush(&pending, row, text);
+                    term_flush_section(col, row, text + col,
+                                       next - col, next - col, st);
+                }
+                else {
+                    paint_run_add(&pending, row, text, col, next - col, ink, false);
+                }
+                col = next;
             }
         }
+        paint_run_flush(&pending, row, text);
     }
-}
-
 
+    memset(dirty, 0, terminal.dirty.words * sizeof(*dirty));
 
-static void
-term_flush_section(size_t col, size_t row, wchar_t *text, size_t length, color_t fg, color_t bg, char_attr_t attr)
-{
-    if (*text == '\0') {
-        bool reverse = terminal.reverse_vid ^ (bool)(attr & CHAR_ATTR_INVERSE);
-        if (config.bce) {
-            (*term_cb->clear_line)(col, row, length,
-                    reverse ? fg : bg);
-        }
-        else {
-            (*term_cb->clear_line)(col, row, length,
-                    reverse ? config.foreground : config.background);
-        }
-    }
-    else if ((attr & CHAR_ATTR_INVISIBLE) ||
-            ((attr & CHAR_ATTR_BLINK) && terminal.blinked)) {
-        (*term_cb->clear_line)(col, row, length,
-                terminal.reverse_vid ? fg : bg);
+    /* Cells that weren't dirty already matched, so the whole row can be
+     * taken */
+    if (line->blank) {
+        shown->blank = true;
+        shown->blank_style = line->blank_style;
     }
     else {
-        if (attr & CHAR_ATTR_INVERSE) {
-            color_t tmp = fg;
-            fg = bg;
-            bg = tmp;
-        }
+        memcpy(shown->text, text, terminal.cols * sizeof(*text));
+        memcpy(shown->style, style, terminal.cols * sizeof(*style));
+        shown->blank = false;
+        shown->hash = line->hash;
+        shown->hashed = line->hashed;
+    }
+    return true;
+}
 
-        if (terminal.reverse_vid) {
-            color_t tmp = fg;
-            fg = bg;
-            bg = tmp;
-        }
+static uint64_t
+term_row_key(struct line_t *line)
+/* Return a key that is the same for rows that look the same, see
+ * draw_row_t. Rows are hashed if they are not already */
+{
+    uint64_t hash, look;
 
-        (*term_cb->write_screen)(col, row, text, length,
-                                 fg, bg,
-                                 attr & CHAR_ATTR_BOLD,
-                                 attr & CHAR_ATTR_UNDERLINE);
+    if (!line_hash(line, &hash)) {
+        hash = line_rehash(line);
     }
+
+    /* What else decides how the row is painted */
+    look = terminal.list.generation << 2 | terminal.reverse_vid << 1 |
+           (line->blink > 0 && terminal.blinked);
+    return splitmix64(hash ^ splitmix64(look ^ (uint64_t)terminal.cols << 32));
 }
 
-static void
-term_flush_cursor()
+static bool /* Return true if we painted */
+term_flushlines()
 {
-    wchar_t c;
-    static size_t last_cursor_X, last_cursor_Y;
-
-    size_t last_cursor = SCREEN(last_cursor_X, last_cursor_Y);
+    struct draw_frame_t *frame = &terminal.list.frame;
+    size_t w, row;
+    uint64_t rows;
+    bool retval = false;
 
-    c = terminal.text[last_cursor].c;
-    term_flush_section(last_cursor_X, last_cursor_Y,
-                       &c, 1,
-                       terminal.text[last_cursor].foreground,
-                       terminal.text[last_cursor].background,
-                       terminal.text[last_cursor].attr);
+    /* Only rows with their bit set are visited */
+    for (w = 0; w * 64 < terminal.rows; w++) {
+        rows = terminal.dirty.rows[w];
+        terminal.dirty.rows[w] = 0;
+        while (rows != 0) {
+            row = w * 64 + __builtin_ctzll(rows);
+            rows &= rows - 1;
+            if (term_flushline(row)) {
+                retval = true;
+                if (term_cb->draw_list != NULL && term_cb->row_keys) {
+                    frame->row[frame->rows].row = row;
+                    frame->row[frame->rows].key = term_row_key(terminal.grid.line + row);
+                    frame->rows++;
+                }
+            }
+        }
+    }
 
-    last_cursor_X = X;
-    last_cursor_Y = Y;
-    terminal.cursor_dirty = false;
+    return retval;
+}
 
-    if (terminal.show_cursor && (!terminal.blink_cursor || !terminal.blinked)) {
-        size_t cursor = SCREEN(X, Y);
+/* How a run is drawn, as kept in the index of draw_group */
+struct draw_key_t {
+    color_t     fg, bg;
+    uint32_t    font; /* 0 for an empty slot, see draw_key */
+    uint32_t    group;
+};
 
-        c = terminal.text[cursor].c;
-        term_flush_section(X, Y,
-                           &c, 1,
-                           config.foreground,
-                           config.background,
-                           terminal.text[cursor].attr ^ CHAR_ATTR_INVERSE);
+static inline struct draw_key_t
+draw_key(const struct draw_run_t *run)
+{
+    struct draw_key_t key = { .bg = run->bg, .font = 1 };
 
+    if (run->text != NULL) {
+        key.fg = run->fg;
+        key.font = 2 | run->bold << 2 | run->underline << 3;
     }
+    return key;
 }
 
-static bool /* Return true if we painted */
-term_flushlines()
+static inline uint32_t
+draw_key_hash(struct draw_key_t key)
 {
-    size_t row;
-    size_t col_start, col_stop, col_this;
-    struct glyph_t *start, *this;
+    /* Palette colors share most of their bits, so a multiply alone
+     * clusters them */
+    return splitmix64(((uint64_t)key.fg << 32 | key.bg) ^ (uint64_t)key.font << 24);
+}
 
-    bool retval = false;
-    wchar_t *buffer = emalloc(terminal.cols * sizeof(*buffer));
+static struct draw_run_t *
+draw_group(const struct draw_run_t *run, size_t runs)
+/* Return the runs reordered into groups drawn alike: fills first, and then
+ * text. Groups come in the order they were first met, and so do the runs
+ * in each. Counted out in one pass over the runs, so no sort is needed */
+{
+    struct arena_t *arena = &terminal.arena;
+    struct draw_run_t *grouped = arena_alloc(arena, runs * sizeof(*grouped));
+    uint32_t *group = arena_alloc(arena, runs * sizeof(*group)); /* Per run */
+    size_t *start = arena_alloc(arena, runs * sizeof(*start)); /* Per group */
+    bool *fill = arena_alloc(arena, runs * sizeof(*fill)); /* Per group */
+    struct draw_key_t *index, key;
+    size_t index_size = 64, groups = 0, i, g, h, at, pass;
+
+    while (index_size < runs * 2) {
+        index_size *= 2;
+    }
+    index = arena_alloc(arena, index_size * sizeof(*index));
+    memset(index, 0, index_size * sizeof(*index));
+
+    for (i = 0; i < runs; i++) {
+        key = draw_key(run + i);
+        for (h = draw_key_hash(key) & (index_size - 1);
+             index[h].font != 0 &&
+             (index[h].font != key.font || index[h].bg != key.bg || index[h].fg != key.fg);
+             h = (h + 1) & (index_size - 1));
+        if (index[h].font == 0) {
+            key.group = groups;
+            index[h] = key;
+            fill[groups] = run[i].text == NULL;
+            start[groups] = 0;
+            groups++;
+        }
+        group[i] = index[h].group;
+        start[group[i]]++;
+    }
 
-    for (row = 0; row < terminal.rows; row ++) {
-        col_start = terminal.dirty[row].left;
-        col_stop  = terminal.dirty[row].right;
-        start = terminal.text + SCREEN(col_start, row);
-
-        for (col_this = col_start, this = start;
-             col_this < col_stop;
-             col_this ++, this++) {
-
-            buffer[col_this] = this->c;
-
-            if ((start->c != '\0')!=(this->c != '\0') || /* NULL vs non-NULL */
-                start->background != this->background ||
-                start->foreground != this->foreground ||
-                start->attr       != this->attr)
-            {
-                term_flush_section(col_start, row,
-                                   buffer + col_start,
-                                   col_this - col_start,
-                                   start->foreground,
-                                   start->background,
-                                   start->attr);
-                col_start = col_this;
-                start = this;
-                retval = true;
+    /* Turn the counts into where each group starts, fills first */
+    at = 0;
+    for (pass = 0; pass < 2; pass++) {
+        for (g = 0; g < groups; g++) {
+            if (fill[g] == (pass == 0)) {
+                h = start[g];
+                start[g] = at;
+                at += h;
             }
-
-        }
-        if (col_stop > col_start) {
-            term_flush_section(col_start, row,
-                               buffer + col_start,
-                               col_this - col_start,
-                               start->foreground,
-                               start->background,
-                               start->attr);
-            retval = true;
         }
+    }
 
-        terminal.dirty[row].left = terminal.dirty[row].right = 0;
+    for (i = 0; i < runs; i++) {
+        grouped[start[group[i]]++] = run[i];
     }
+    return grouped;
+}
 
-    free(buffer);
-    return retval;
+static void
+term_draw_list()
+/* Pass the frame gathered to term_cb->draw_list */
+{
+    struct draw_frame_t frame = terminal.list.frame;
+
+    frame.run = draw_group(frame.run, frame.runs);
+    (*term_cb->draw_list)(&frame);
 }
 
 void
 term_flush()
 {
     struct timeval now;
-    static struct timeval next_blink;
+    static struct timeval next_blink; /* Cleared while nothing blinks */
 
-    gettimeofday(&now, NULL);
-    if (timercmp(&now, &next_blink, >)) {
-        terminal.blinked = !terminal.blinked;
-        timeradd(&now, &config.blink_delay, &next_blink);
-        term_invalidate_blinkers();
+    arena_reset(&terminal.arena);
+
+    if (!term_blinking()) {
+        timerclear(&next_blink);
+        terminal.blinked = false;
+    }
+    else {
+        gettimeofday(&now, NULL);
+        if (!timerisset(&next_blink)) {
+            /* Something started blinking, it is shown first */
+            timeradd(&now, &config.blink_delay, &next_blink);
+        }
+        else if (timercmp(&now, &next_blink, >)) {
+            terminal.blinked = !terminal.blinked;
+            timeradd(&now, &config.blink_delay, &next_blink);
+            term_invalidate_blinkers();
+            terminal.cursor_dirty |= terminal.blink_cursor;
+        }
     }
 
-    if (term_flushlines() || terminal.cursor_dirty) {
+    terminal.list.frame.runs = 0;
+    terminal.list.frame.row = arena_alloc(&terminal.arena,
+            terminal.rows * sizeof(*terminal.list.frame.row));
+    terminal.list.frame.rows = 0;
+    terminal.list.frame.scroll.lines = 0;
+    terminal.list.frame.show_cursor = false;
+    terminal.list.cursor_covered = false;
+
+    bool scrolled = term_flush_scroll();
+
+    if (term_flushlines() || scrolled || terminal.cursor_dirty) {
         term_flush_cursor();
-        (*term_cb->write_finished)();
+        if (term_cb->draw_list != NULL) {
+            term_draw_list();
+        }
+        else {
+            (*term_cb->write_finished)();
+        }
     }
 }
 
@@ -622,6 +2316,20 @@ term_write(char *utf8s)
         if (*utf8s == '\0') {
             break;
         }
+        else if ((*utf8s == '\n' || *utf8s == '\v' || *utf8s == '\f') &&
+                 terminal.y == terminal.margin.bottom && esc_idle()) {
+            term_newlines(utf8s + 1);
+            n = 1;
+        }
+        else if (between(*utf8s, 0x20, 0x7e) && esc_idle()) {
+            /* Plain ASCII needs no decoding */
+            uint32_t run[256];
+
+            for (n = 0; n < LENGTH(run) && between(utf8s[n], 0x20, 0x7e); n++) {
+                run[n] = utf8s[n];
+            }
+            term_write_run(run, n);
+        }
         else if (term_do_control_char(*utf8s)) {
             n = 1;
         }
@@ -638,8 +2346,15 @@ term_write(char *utf8s)
 void
 term_init(struct term_push_callbacks *callbacks)
 {
+    struct timeval now;
+
     term_cb = callbacks;
     esc_init(esc_dispatch, csi_dispatch, osc_dispatch);
+    kernels_init();
+
+    /* Output can't be crafted to collide in row hashes it can't predict */
+    gettimeofday(&now, NULL);
+    terminal.hash.seed = splitmix64((uint64_t)now.tv_sec * 1000000 + now.tv_usec) ^ getpid();
 
     term_reset();
 
@@ -682,6 +2397,14 @@ term_tab_move(int n)
     term_cursor(x, Y);
 }
 
+static void
+saved_cur_clamp(struct saved_cur_t *saved)
+/* Keep a saved cursor on a screen that got smaller */
+{
+    saved->x = min(saved->x, terminal.cols - 1);
+    saved->y = min(saved->y, terminal.rows - 1);
+}
+
 void
 term_resize(size_t cols, size_t rows)
 {
@@ -710,38 +2433,54 @@ term_resize(size_t cols, size_t rows)
         return;
     }
 
-    term_align(NULL, NULL, NULL);
-
-    size_t i;
-    size_t newsize = cols * rows * sizeof(*terminal.text);
-
-    struct glyph_t *newtext = emalloc(newsize);
-    memset(newtext, 0, newsize);
-    /* Transfer old lines */
-    for (i = 0; i < min(rows, terminal.rows); i ++) {
-        memcpy(newtext +       i * cols,
-               terminal.text + i * terminal.cols,
-               sizeof(*terminal.text) * min(cols, terminal.cols));
-    }
+    size_t capacity = terminal.grid.cols * terminal.grid.rows;
+    size_t capacity_cols = terminal.grid.cols, i;
 
-    if (terminal.text != NULL) {
-        free(terminal.text);
+    /* Both grids have the same allocated size */
+    grid_resize(&terminal.grid, cols, rows);
+    grid_resize(&terminal.front, cols, rows);
+    if (terminal.inactive.line != NULL) {
+        grid_resize(&terminal.inactive, cols, rows);
     }
 
-    terminal.text = newtext;
     terminal.cols = cols;
     terminal.rows = rows;
 
+    /* Per row and column arrays follow the allocated size of the grid */
+    if (terminal.grid.cols * terminal.grid.rows != capacity) {
+        terminal.tabstop = erealloc(terminal.tabstop, terminal.grid.cols);
+        terminal.dirty.words = (terminal.grid.cols + 63) / 64;
+        terminal.dirty.rows  = erealloc(terminal.dirty.rows,
+                (terminal.grid.rows + 63) / 64 * sizeof(uint64_t));
+        terminal.dirty.cells = erealloc(terminal.dirty.cells,
+                terminal.grid.rows * terminal.dirty.words * sizeof(uint64_t));
+    }
+    if (terminal.grid.cols != capacity_cols) {
+        terminal.hash.key = erealloc(terminal.hash.key,
+                terminal.grid.cols * sizeof(uint64_t));
+        for (i = 0; i < terminal.grid.cols; i++) {
+            terminal.hash.key[i] = splitmix64(terminal.hash.seed + i) | 1;
+        }
+    }
+    for (i = 0, terminal.hash.sum = 0; i < cols; i++) {
+        terminal.hash.sum += terminal.hash.key[i];
+    }
+
     /* TODO: really reset tabstops here ? */
-    terminal.tabstop = erealloc(terminal.tabstop, cols);
     term_tabs_clear();
     if (config.tabsize > 0)
         term_tabs_every(config.tabsize);
 
     term_setscrollregion(-1, -1);
     term_cursor(X, Y); /* Reset cursor */
-
-    terminal.dirty = realloc(terminal.dirty, rows * sizeof(*terminal.dirty));
+    saved_cur_clamp(&terminal.saved_cur);
+    saved_cur_clamp(&terminal.inactive_saved_cur);
+    terminal.cursor_painted.x = X; /* Its old place may be gone, all is repainted */
+    terminal.cursor_painted.y = terminal.y;
+
+    memset(terminal.dirty.rows, 0, (rows + 63) / 64 * sizeof(uint64_t));
+    memset(terminal.dirty.cells, 0, rows * terminal.dirty.words * sizeof(uint64_t));
+    terminal.scroll.lines = 0;
     term_invalidate();
 
     /* Notify */
@@ -755,9 +2494,21 @@ static void
 term_destroy()
 {
     debug(".");
-    free(terminal.text);
-    free(terminal.dirty);
+    grid_free(&terminal.grid);
+    grid_free(&terminal.inactive);
+    grid_free(&terminal.front);
+    free(terminal.dirty.rows);
+    free(terminal.dirty.cells);
     free(terminal.tabstop);
+    free(terminal.hash.key);
+    free(terminal.list.frame.run);
+    arena_free(&terminal.arena);
+    free(terminal.styles.style);
+    free(terminal.styles.index);
+    free(terminal.clusters.cluster);
+    free(terminal.clusters.index);
+    free(terminal.truecolor.color);
+    free(terminal.truecolor.index);
 }
 
 static bool
@@ -851,6 +2602,56 @@ term_do_control_char(char c)
     return false;
 }
 
+static void
+term_combine(wchar_t ch)
+/* Add combining character ch to the most recently printed glyph */
+{
+    wchar_t cluster[CLUSTER_LENGTH];
+    size_t length, x, i;
+
+    if (terminal.wrap_next) {
+        x = X;
+    }
+    else if (X > BOL) {
+        x = X - 1;
+    }
+    else {
+        return;
+    }
+
+    i = PAGE(x, Y);
+    if (*TEXT(i) == GLYPH_WIDE_TAIL && x > BOL) {
+        i -= 1;
+        x -= 1;
+    }
+    if (*TEXT(i) == '\0' || *TEXT(i) == GLYPH_WIDE_TAIL) {
+        return;
+    }
+
+    if (style_get(*STYLE(i)).attr & CHAR_ATTR_COMBINED) {
+        wchar_t *old = cluster_get(*TEXT(i), &length);
+        memcpy(cluster, old, length * sizeof(*cluster));
+    }
+    else {
+        cluster[0] = *TEXT(i);
+        length = 1;
+    }
+
+    if (length >= CLUSTER_LENGTH) {
+        return;
+    }
+    cluster[length++] = ch;
+
+    wchar_t id = cluster_intern(cluster, length);
+    if (id == '\0') {
+        return;
+    }
+
+    cell_set(LINE(i), x, id, style_set_attr(*STYLE(i), CHAR_ATTR_COMBINED, true));
+
+    term_damage(terminal.y, x, x + 1);
+}
+
 static void
 term_writechar(wchar_t ch)
 {
@@ -862,36 +2663,148 @@ term_writechar(wchar_t ch)
 
     debug("%lc (%02x)", ch, ch);
 
+    size_t width = char_width(ch);
+    if (width == 0) {
+        term_combine(ch);
+        return;
+    }
+    if (terminal.cols < 2) {
+        width = 1;
+    }
+
     if (terminal.insert) {
-        term_insert(PAGE(X,Y), 1, PAGE(EOL,Y));
+        term_insert(PAGE(X,Y), width, PAGE(EOL,Y));
     }
 
     if ((X >= EOL) && terminal.wrap_next && terminal.autowrap) {
         term_newline(true);
     }
 
+    if (X + width - 1 > EOL) {
+        /* Double width glyph doesn't fit on this line */
+        if (terminal.autowrap) {
+            term_newline(true);
+        }
+        else {
+            term_cursor(EOL - 1, Y);
+        }
+    }
+
+    struct line_t *line = line_materialize(LINE(PAGE(X,Y)), terminal.cols);
+    size_t dirty_left = X, dirty_right = X + width;
 
-    struct glyph_t *g = terminal.text + PAGE(X,Y);
+    /* Overwriting half of a double width glyph blanks the other half */
+    if (X > BOL && line->text[X] == GLYPH_WIDE_TAIL) {
+        cell_set(line, X - 1, ' ',
+                 style_set_attr(line->style[X - 1], CHAR_ATTR_COMBINED, false));
+        dirty_left -= 1;
+    }
+    if (X + width <= EOL && line->text[X + width] == GLYPH_WIDE_TAIL) {
+        cell_set(line, X + width, ' ',
+                 style_set_attr(line->style[X + width], CHAR_ATTR_COMBINED, false));
+        dirty_right += 1;
+    }
 
-    g->c = ch;
-    g->foreground = terminal.style.foreground;
-    g->background = terminal.style.background;
-    g->attr       = terminal.style.attr;
+    cell_set(line, X, ch, terminal.style_id);
+
+    if (width == 2) {
+        cell_set(line, X + 1, GLYPH_WIDE_TAIL, terminal.style_id);
+    }
+    if (terminal.style.attr & CHAR_ATTR_BLINK) {
+        line->blink += width;
+    }
 
-    terminal.dirty[terminal.y].left  = min(X, terminal.dirty[terminal.y].left);
-    terminal.dirty[terminal.y].right = max(X + 1, terminal.dirty[terminal.y].right);
+    term_damage(terminal.y, dirty_left, dirty_right);
 
-    if (X < EOL) {
-        term_cursor(X + 1, Y);
+    if (X + width <= EOL) {
+        term_cursor(X + width, Y);
         terminal.wrap_next = false;
     }
     else {
+        term_cursor(EOL, Y);
         terminal.wrap_next = true;
     }
 
     terminal.lastchar = ch;
 }
 
+static void
+term_write_run(const uint32_t *cps, size_t n)
+/* Write n characters. Single width characters are written up to a line at
+ * a time, anything else goes through term_writechar */
+{
+    size_t room, k, i;
+    struct line_t *line;
+    size_t dirty_left, dirty_right;
+
+    while (n > 0) {
+        if (terminal.charset[terminal.charset_mode] == CHARSET_DEC ||
+            char_width(cps[0]) != 1) {
+            term_writechar(cps[0]);
+            cps += 1;
+            n   -= 1;
+            continue;
+        }
+
+        if ((X >= EOL) && terminal.wrap_next && terminal.autowrap) {
+            term_newline(true);
+        }
+
+        room = EOL - X + 1;
+        for (k = 1; k < min(n, room) && char_width(cps[k]) == 1; k++);
+
+        if (terminal.insert) {
+            term_insert(PAGE(X,Y), k, PAGE(EOL,Y));
+        }
+
+        line = line_materialize(LINE(PAGE(X,Y)), terminal.cols);
+        dirty_left  = X;
+        dirty_right = X + k;
+
+        /* Overwriting half of a double width glyph blanks the other half */
+        if (X > BOL && line->text[X] == GLYPH_WIDE_TAIL) {
+            cell_set(line, X - 1, ' ',
+                     style_set_attr(line->style[X - 1], CHAR_ATTR_COMBINED, false));
+            dirty_left -= 1;
+        }
+        if (X + k <= EOL && line->text[X + k] == GLYPH_WIDE_TAIL) {
+            cell_set(line, X + k, ' ',
+                     style_set_attr(line->style[X + k], CHAR_ATTR_COMBINED, false));
+            dirty_right += 1;
+        }
+
+        if (k <= HASH_RUN_MAX) {
+            for (i = 0; i < k; i++) {
+                cell_set(line, X + i, cps[i], terminal.style_id);
+            }
+        }
+        else {
+            for (i = 0; i < k; i++) {
+                line->text[X + i]  = cps[i];
+                line->style[X + i] = terminal.style_id;
+            }
+            line->hashed = false;
+        }
+        if (terminal.style.attr & CHAR_ATTR_BLINK) {
+            line->blink += k;
+        }
+
+        term_damage(terminal.y, dirty_left, dirty_right);
+
+        if (X + k <= EOL) {
+            term_cursor(X + k, Y);
+        }
+        else {
+            term_cursor(EOL, Y);
+            terminal.wrap_next = true;
+        }
+
+        terminal.lastchar = cps[k - 1];
+        cps += k;
+        n   -= k;
+    }
+}
+
 static void
 term_writechar_times(const wchar_t ch, size_t times)
 {
@@ -907,9 +2820,7 @@ term_writechar_times(const wchar_t ch, size_t times)
 static void
 term_reset()
 {
-    terminal.style.foreground = config.foreground;
-    terminal.style.background = config.background;
-    terminal.style.attr       = CHAR_ATTR_NONE;
+    style_clear(); /* The grid is cleared below */
 
     terminal.autowrap = true;
     terminal.lastchar = '\0';
@@ -928,18 +2839,91 @@ term_reset()
     terminal.col_mode = COL_ANY;
     terminal.no_clear_on_col_mode_change = false;
 
+    if (terminal.alt_screen) { /* Back to the main screen */
+        grid_free(&terminal.grid);
+        terminal.grid = terminal.inactive;
+        memset(&terminal.inactive, 0, sizeof(terminal.inactive));
+        terminal.saved_cur = terminal.inactive_saved_cur;
+        terminal.alt_screen = false;
+    }
+    grid_free(&terminal.inactive);
+
     if (terminal.cols != 0 && terminal.rows != 0) {
         term_cursor(BOL, TOP);
-        if (terminal.text != NULL)
-            memset(terminal.text, 0, terminal.cols * terminal.rows * sizeof(*terminal.text));
-        terminal.ring_top = 0;
+        if (terminal.grid.line != NULL) {
+            grid_clear(&terminal.grid);
+        }
+        cluster_clear();
 
         term_setscrollregion(-1, -1);
     }
 
+    terminal.list.generation++; /* Style and cluster ids start over */
     term_invalidate();
 }
 
+static void
+term_save_cursor()
+{
+    terminal.saved_cur.x = terminal.x;
+    terminal.saved_cur.y = terminal.y;
+    terminal.saved_cur.autowrap = terminal.autowrap;
+    terminal.saved_cur.style = terminal.style;
+    memcpy(terminal.saved_cur.charset, terminal.charset, sizeof(terminal.charset));
+    terminal.saved_cur.charset_mode = terminal.charset_mode;
+}
+
+static void
+term_restore_cursor()
+{
+    saved_cur_clamp(&terminal.saved_cur);
+    terminal.x = terminal.saved_cur.x;
+    terminal.y = terminal.saved_cur.y;
+    terminal.wrap_next = false;
+    terminal.autowrap = terminal.saved_cur.autowrap;
+    terminal.style = terminal.saved_cur.style;
+    terminal.style_id = style_intern(terminal.style);
+    memcpy(terminal.charset, terminal.saved_cur.charset, sizeof(terminal.charset));
+    terminal.charset_mode = terminal.saved_cur.charset_mode;
+    terminal.cursor_dirty = true;
+}
+
+static void
+term_alt_screen(bool enable, bool clear)
+/* Switch between the main and the alternate screen. The grids trade
+ * places, as do the cursors saved on them, and only cells that differ
+ * between them are repainted. If clear is set, the alternate screen is
+ * blanked when entering or leaving it.
+ */
+{
+    if (enable == terminal.alt_screen) {
+        return;
+    }
+
+    if (terminal.inactive.line == NULL) {
+        grid_alloc(&terminal.inactive, terminal.grid.cols, terminal.grid.rows);
+    }
+
+    struct grid_t shown = terminal.grid;
+    terminal.grid = terminal.inactive;
+    terminal.inactive = shown;
+    struct saved_cur_t saved = terminal.saved_cur;
+    terminal.saved_cur = terminal.inactive_saved_cur;
+    terminal.inactive_saved_cur = saved;
+    terminal.alt_screen = enable;
+
+    if (enable && clear) {
+        grid_clear(&terminal.grid);
+    }
+    term_invalidate_diff(&terminal.inactive);
+    if (!enable && clear) {
+        grid_clear(&terminal.inactive);
+    }
+
+    terminal.wrap_next = false;
+    terminal.cursor_dirty = true;
+}
+
 static void
 term_report_cursor_pos()
 {
@@ -976,8 +2960,6 @@ term_setscrollregion(size_t top, size_t bottom)
     if (bottom <= top)
         return;
 
-    term_align(NULL, NULL, NULL);
-
     terminal.margin.top    = top - 1;
     terminal.margin.bottom = bottom - 1;
     terminal.margin.height = bottom - top + 1;
@@ -1002,8 +2984,8 @@ term_setcharattributes(int32_t arg[CSI_MAXARGS])
         switch(c) {
             case 0:
                 terminal.style.attr = CHAR_ATTR_NONE;
-                terminal.style.foreground = config.foreground;
-                terminal.style.background = config.background;
+                terminal.style.foreground = COLOR_DEFAULT;
+                terminal.style.background = COLOR_DEFAULT;
                 continue;
             case 1:
                 terminal.style.attr |= CHAR_ATTR_BOLD;
@@ -1037,46 +3019,55 @@ term_setcharattributes(int32_t arg[CSI_MAXARGS])
                 terminal.style.attr &= ~CHAR_ATTR_INVISIBLE;
                 continue;
             case 39:
-                terminal.style.foreground = config.foreground;
+                terminal.style.foreground = COLOR_DEFAULT;
                 continue;
             case 49:
-                terminal.style.background = config.background;
+                terminal.style.background = COLOR_DEFAULT;
                 continue;
         }
 
         if (between(c, 30, 37)) {
-            terminal.style.foreground = config.color[c - 30];
+            terminal.style.foreground = COLOR_PALETTE + (c - 30);
             continue;
         }
         if (between(c, 40, 47)) {
-            terminal.style.background = config.color[c - 40];
+            terminal.style.background = COLOR_PALETTE + (c - 40);
             continue;
         }
 
         if (between(c, 90, 97)) {
-            terminal.style.foreground = config.color[(c - 90) + 8];
+            terminal.style.foreground = COLOR_PALETTE + (c - 90) + 8;
             continue;
         }
         if (between(c, 100, 107)) {
-            terminal.style.background = config.color[(c - 100) + 8];
+            terminal.style.background = COLOR_PALETTE + (c - 100) + 8;
             continue;
         }
 
-        if ((c == 38 || c == 48) && arg[i + 1] == 5) {
-            if (i < sizeof(arg) - 2) {
-                int color_id = arg[i + 2] % sizeof(config.color);
+        if ((c == 38 || c == 48) && i + 1 < CSI_MAXARGS) {
+            color_index_t color;
 
-                if (c == 38) {
-                    terminal.style.foreground = config.color[color_id];
-                } else {
-                    terminal.style.background = config.color[color_id];
-                }
+            if (arg[i + 1] == 5 && i + 2 < CSI_MAXARGS) {
+                color = COLOR_PALETTE + limit(arg[i + 2], 0, LENGTH(config.color) - 1);
                 i += 2;
-                continue;
+            }
+            else if (arg[i + 1] == 2 && i + 4 < CSI_MAXARGS) {
+                color = truecolor_intern(limit(arg[i + 2], 0, 255) << 16 |
+                                         limit(arg[i + 3], 0, 255) << 8 |
+                                         limit(arg[i + 4], 0, 255));
+                i += 4;
             }
             else {
                 warning("Too few parameters left for %d", c);
+                break;
+            }
+
+            if (c == 38) {
+                terminal.style.foreground = color;
+            } else {
+                terminal.style.background = color;
             }
+            continue;
         }
 
         warning("Unknown style: %d", c);
@@ -1084,6 +3075,8 @@ term_setcharattributes(int32_t arg[CSI_MAXARGS])
 
     debug("%d", terminal.style.attr);
 
+    terminal.style_id = style_intern(terminal.style);
+
 }
 
 
@@ -1150,13 +3143,25 @@ csi_dispatch(char function, int32_t arg[CSI_MAXARGS], char privflag)
         term_tab_move(arg[0]);
         break;
     /* Editing */
+    case 'S': /* SU - Scroll up */
+        CSI_DEFAULT(arg[0], 1);
+        term_scroll(terminal.margin.top, terminal.margin.bottom, (int)min(arg[0], terminal.rows));
+        break;
+    case 'T': /* SD - Scroll down */
+        CSI_DEFAULT(arg[0], 1);
+        term_scroll(terminal.margin.top, terminal.margin.bottom, -(int)min(arg[0], terminal.rows));
+        break;
     case 'L': /* IL - Insert Lines */
         CSI_DEFAULT(arg[0], 1);
-        term_insert(PAGE(BOL, Y), arg[0] * terminal.cols, PAGE(EOL, BOTTOM));
+        if (between(terminal.y, terminal.margin.top, terminal.margin.bottom)) {
+            term_scroll(terminal.y, terminal.margin.bottom, -(int)min(arg[0], terminal.rows));
+        }
         break;
     case 'M': /* DL - Delete Lines */
         CSI_DEFAULT(arg[0], 1);
-        term_delete(PAGE(BOL, Y), PAGE(EOL, Y + arg[0] - 1), PAGE(EOL, BOTTOM));
+        if (between(terminal.y, terminal.margin.top, terminal.margin.bottom)) {
+            term_scroll(terminal.y, terminal.margin.bottom, (int)min(arg[0], terminal.rows));
+        }
         break;
     case '@': /* ICH - Insert Character */
         CSI_DEFAULT(arg[0], 1);
@@ -1226,6 +3231,22 @@ csi_dispatch(char function, int32_t arg[CSI_MAXARGS], char privflag)
                 case 95: /* DECNCSM - No Clearing Screen On Column Change Mode */
                     terminal.no_clear_on_col_mode_change = (function == 'h');
                     continue;
+                case 47:  /* Use alternate screen */
+                    term_alt_screen(function == 'h', false);
+                    continue;
+                case 1047:/* Use alternate screen, clear it when leaving */
+                    term_alt_screen(function == 'h', function == 'l');
+                    continue;
+                case 1049:/* Save cursor and use cleared alternate screen */
+                    if (function == 'h') {
+                        term_save_cursor();
+                        term_alt_screen(true, true);
+                    }
+                    else {
+                        term_alt_screen(false, false);
+                        term_restore_cursor();
+                    }
+                    continue;
                 case 1: /* DECCKM - Cursor keys */
                 case 9: /* Send mouse X & Y on button press */
                     CSI_TODO;
@@ -1363,8 +3384,6 @@ csi_dispatch(char function, int32_t arg[CSI_MAXARGS], char privflag)
     case '4': /* DECDHL - Double height letters, top half */
     case '5': /* DECSWL - Single width, single height letters */
     case '6': /* DECDWL - Double width, single height letters */
-    case 'S': /* SU - Scroll up */
-    case 'T': /* SD - Scroll down */
         CSI_IGNORED;
         break;
     default:
@@ -1483,24 +3502,10 @@ esc_dispatch(char function, char intermediate)
             term_reset();
             break;
         case '7': /* DECSC - Save Cursor */
-            terminal.saved_cur.x = terminal.x;
-            terminal.saved_cur.y = terminal.y;
-            terminal.saved_cur.autowrap = terminal.autowrap;
-            terminal.saved_cur.foreground = terminal.style.foreground;
-            terminal.saved_cur.background = terminal.style.background;
-            terminal.saved_cur.attr = terminal.style.attr;
-            memcpy(terminal.saved_cur.charset, terminal.charset, sizeof(terminal.charset));
-            terminal.saved_cur.charset_mode = terminal.charset_mode;
+            term_save_cursor();
             break;
         case '8': /* DECRC - Restore Cursor*/
-            terminal.x = terminal.saved_cur.x;
-            terminal.y = terminal.saved_cur.y;
-            terminal.autowrap = terminal.saved_cur.autowrap;
-            terminal.style.foreground = terminal.saved_cur.foreground;
-            terminal.style.background = terminal.saved_cur.background;
-            terminal.style.attr = terminal.saved_cur.attr;
-            memcpy(terminal.charset, terminal.saved_cur.charset, sizeof(terminal.charset));
-            terminal.charset_mode = terminal.saved_cur.charset_mode;
+            term_restore_cursor();
             break;
         case '=': /* DECPAM - Set alternate keypad mode */
             warning("TODO: implement DECPAM");
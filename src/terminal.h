@@ -5,19 +5,76 @@
 
 #include "types.h"
 
-/* Callback to draw function */
+/* Callback to draw function. Cells of text that are '\0' are blank, and
+ * drawn as spaces */
 typedef void (*write_screen_t)(size_t col, size_t row, wchar_t text[], size_t length, color_t fg, color_t bg, bool bold, bool underline);
+/* Draw one cell: a base character followed by its combining characters */
+typedef void (*write_cluster_t)(size_t col, size_t row, wchar_t text[], size_t length, color_t fg, color_t bg, bool bold, bool underline);
 typedef void (*clear_line_t)(size_t col, size_t row, size_t length, color_t bg);
 typedef void (*write_finished_t)();
 typedef void (*write_host_t)(const char *str, size_t n);
 typedef void (*res_change_t)(size_t cols, size_t rows);
+/* Move the contents of rows top..bottom (inclusive) up by lines, or down if
+ * negative. The rows uncovered are repainted afterwards */
+typedef void (*scroll_t)(size_t top, size_t bottom, int lines);
+
+/* Cells painted alike. Their text is length characters, as for
+ * write_screen, or NULL when the cells only show bg */
+struct draw_run_t {
+    size_t      col, row, cells;
+    wchar_t    *text;
+    size_t      length;
+    color_t     fg, bg;
+    bool        bold, underline;
+    bool        cluster; /* text is one glyph, as for write_cluster */
+    bool        wide; /* A double width glyph. The cells are filled with
+                         bg before it is drawn */
+};
+
+/* A row painted in the frame, listed if the backend sets row_keys. Rows
+ * with the same key look the same, so what a backend drew for one can be
+ * reused for the other */
+struct draw_row_t {
+    size_t      row;
+    uint64_t    key;
+};
+
+/* Everything painted in one term_flush, in the order it is to be drawn:
+ * the scroll, the runs and then the cursor. Runs don't overlap, so they
+ * are grouped: fills come first, together by bg, and then text, together
+ * by colors and font. Pointers are valid during the call only */
+struct draw_frame_t {
+    struct {
+        size_t  top, bottom;
+        int     lines; /* 0 if nothing was scrolled, as for scroll_t */
+    }           scroll; /* Only given when scroll_t is set */
+    struct draw_run_t *run;
+    size_t      runs;
+    struct draw_row_t *row; /* Rows repainted, each once, see row_keys */
+    size_t      rows;
+    struct draw_run_t cursor;
+    bool        show_cursor;
+};
+typedef void (*draw_list_t)(const struct draw_frame_t *list);
 
 struct term_push_callbacks {
     write_host_t        write_host;
     write_screen_t      write_screen;
+    write_cluster_t     write_cluster;  /* Optional */
     write_finished_t    write_finished;
     clear_line_t        clear_line;
     res_change_t        res_change;
+    scroll_t            scroll;         /* Optional */
+    draw_list_t         draw_list;      /* Optional. When set, each frame
+                                         * is passed whole to it instead of
+                                         * write_screen, write_cluster,
+                                         * clear_line, scroll and
+                                         * write_finished */
+    bool                row_keys;       /* List the rows painted in each
+                                         * draw list, with their keys.
+                                         * Keys cost a pass over unhashed
+                                         * rows, so they are only made on
+                                         * request */
 };
 
 void term_gc();
@@ -33,6 +33,9 @@ struct config_t {
 
     unsigned int    color[256];
     struct timeval  blink_delay;
+    struct timeval  resize_delay;
+    size_t          row_cache_size;
+    bool            xshm;
 };
 
 
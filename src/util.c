@@ -75,3 +75,58 @@ erealloc(void *ptr, size_t size)
     }
     return p;
 }
+
+#define ARENA_ALIGN 16
+
+void*
+arena_alloc(struct arena_t *arena, size_t size)
+{
+    void **spill;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->wanted += size;
+
+    if (arena->used + size <= arena->size) {
+        void *p = arena->base + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    /* Each spill starts with a pointer to the previous one */
+    spill = emalloc(ARENA_ALIGN + size);
+    *spill = arena->spill;
+    arena->spill = spill;
+    return (char *)spill + ARENA_ALIGN;
+}
+
+void
+arena_reset(struct arena_t *arena)
+/* Release everything allocated from the arena */
+{
+    void *spill, *next;
+
+    if (arena->spill != NULL) {
+        for (spill = arena->spill; spill != NULL; spill = next) {
+            next = *(void **)spill;
+            free(spill);
+        }
+        arena->spill = NULL;
+
+        /* Room for all of it next time */
+        free(arena->base);
+        arena->size = arena->wanted;
+        arena->base = emalloc(arena->size);
+    }
+
+    arena->used = 0;
+    arena->wanted = 0;
+}
+
+void
+arena_free(struct arena_t *arena)
+{
+    arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+}
@@ -11,6 +11,22 @@ size_t utf8towchar(char *source, wchar_t *dest);
 void* emalloc(size_t size);
 void* erealloc(void *ptr, size_t size);
 
+/* Bump allocator for scratch memory that lives until the next reset.
+ * Allocations that don't fit are made on the heap, and the arena grows to
+ * hold them all at the next reset, so that it settles after a few rounds.
+ */
+struct arena_t {
+    char       *base;
+    size_t      size;
+    size_t      used;
+    size_t      wanted; /* Bytes asked for since the last reset */
+    void       *spill;  /* Heap allocations that didn't fit, a linked list */
+};
+
+void* arena_alloc(struct arena_t *arena, size_t size);
+void arena_reset(struct arena_t *arena);
+void arena_free(struct arena_t *arena);
+
 void util_init();
 
 #define LENGTH(array) (sizeof(array) / sizeof(array[0]))
@@ -0,0 +1,5 @@
+/* The table is generated at build time by util/wcwidthgen.c */
+
+#include "wcwidth.h"
+
+#include "wcwidth_table.h"
@@ -0,0 +1,29 @@
+/* Number of cells a codepoint occupies on screen */
+
+#ifndef _WCWIDTH_H
+#define _WCWIDTH_H
+
+#include <stdint.h>
+
+extern const uint8_t wcwidth_index[];
+extern const uint8_t wcwidth_blocks[][64];
+
+/* Return 0 for combining characters, 2 for East Asian wide and full width
+ * characters, and 1 for everything else. Control characters are not
+ * handled; they never reach the screen.
+ */
+static inline int
+char_width(uint32_t cp)
+{
+    if (cp < 0x300) {
+        return 1; /* Nothing below the combining diacritics is special */
+    }
+    if (cp >= 0x110000) {
+        return 1;
+    }
+
+    return (wcwidth_blocks[wcwidth_index[cp >> 8]][(cp & 0xff) >> 2]
+                >> ((cp & 3) * 2)) & 3;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/* Time of each kernel at common terminal widths, for each set of kernels
+ * the CPU runs. Run with "make bench".
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+#include "util.h"
+
+#define CELLS_MAX 512
+
+static const size_t widths[] = { 80, 132, 200, 400 };
+
+static wchar_t text[CELLS_MAX], shown_text[CELLS_MAX];
+static uint16_t style[CELLS_MAX], shown_style[CELLS_MAX];
+static uint32_t pixels[CELLS_MAX * 8]; /* A row of a glyph 8 pixels wide */
+static uint8_t mask[CELLS_MAX * 8];
+static volatile uint64_t sink; /* Keeps results from being optimized out */
+
+static double
+now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Kernels {{{ */
+
+static void
+run_fill_text(size_t width)
+{
+    kernels.fill_text(text, 'x', width);
+}
+
+static void
+run_fill_style(size_t width)
+{
+    kernels.fill_style(style, 7, width);
+}
+
+static void
+run_style_run(size_t width)
+/* A row in one style, so the whole width is searched */
+{
+    sink += kernels.style_run(style, width);
+}
+
+static void
+run_cells_differ(size_t width)
+/* A row compared with what is shown, unchanged, as term_front_diff does */
+{
+    size_t col;
+
+    for (col = 0; col < width; col += 64) {
+        sink += kernels.cells_differ(text + col, style + col,
+                                     shown_text + col, shown_style + col,
+                                     min(64, width - col));
+    }
+}
+
+static void
+run_fill_pixels(size_t width)
+/* A scanline of a row's background */
+{
+    kernels.fill_pixels(pixels, 0x00202020, width * 8);
+}
+
+static void
+run_mask_pixels(size_t width)
+/* A scanline of a row's glyphs, about a third of it set */
+{
+    kernels.mask_pixels(pixels, mask, 0x00e0e0e0, width * 8);
+}
+
+/* }}} */
+
+static double
+bench(void (*run)(size_t), size_t width)
+/* Return the fastest of a few rounds, in nanoseconds per call */
+{
+    const size_t rounds = 5, iterations = 20000;
+    size_t i, r;
+    double start, nsec, best = 1e12;
+
+    for (r = 0; r < rounds; r++) {
+        start = now();
+        for (i = 0; i < iterations; i++) {
+            run(width);
+        }
+        nsec = (now() - start) * 1e9 / iterations;
+        if (nsec < best) {
+            best = nsec;
+        }
+    }
+    return best;
+}
+
+int main()
+{
+    static const struct {
+        const char *name;
+        void      (*run)(size_t width);
+    } kernel[] = {
+        { "fill_text",    run_fill_text },
+        { "fill_style",   run_fill_style },
+        { "style_run",    run_style_run },
+        { "cells_differ", run_cells_differ },
+        { "fill_pixels",  run_fill_pixels },
+        { "mask_pixels",  run_mask_pixels },
+    };
+    const char *name;
+    size_t k, w, v, i;
+
+    for (i = 0; i < LENGTH(mask); i++) {
+        mask[i] = i % 8 < 3 ? 0xff : 0;
+    }
+
+    printf("%-16s %6s", "ns/call", "width");
+    for (v = 0; (name = kernels_list(v)) != NULL; v++) {
+        printf(" %8s", name);
+    }
+    printf("\n");
+
+    for (k = 0; k < LENGTH(kernel); k++) {
+        for (w = 0; w < LENGTH(widths); w++) {
+            printf("%-16s %6lu", kernel[k].name, (unsigned long)widths[w]);
+            for (v = 0; (name = kernels_list(v)) != NULL; v++) {
+                if (!kernels_select(name)) {
+                    printf(" %8s", "-");
+                    continue;
+                }
+                /* Rows as term_front_diff finds them most of the time */
+                kernels.fill_text(text, 'x', CELLS_MAX);
+                kernels.fill_text(shown_text, 'x', CELLS_MAX);
+                kernels.fill_style(style, 7, CELLS_MAX);
+                kernels.fill_style(shown_style, 7, CELLS_MAX);
+                printf(" %8.1f", bench(kernel[k].run, widths[w]));
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
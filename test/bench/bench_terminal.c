@@ -0,0 +1,454 @@
+/* Throughput of the terminal emulation and of term_flush, without X.
+ * Run with "make bench". Cache misses are read from the hardware
+ * counters where the kernel allows it. Heap allocations are counted by
+ * wrapping glibc's malloc.
+ */
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "terminal.h"
+
+#define COLS 400
+#define ROWS 120
+
+static struct {
+    size_t writes;   /* write_screen calls */
+    size_t clears;   /* clear_line calls */
+    size_t cells;    /* cells painted */
+} painted;
+
+static size_t allocations; /* malloc, calloc and realloc calls */
+
+static char screen[COLS * ROWS * 16]; /* one full screen of output */
+static char styled[COLS * ROWS * 32]; /* same, with short style runs */
+static char panes[4096]; /* scrolling in two panes, as tmux does */
+static char lines[64 * 1024]; /* short lines scrolling by, as from cat */
+static char sparse[COLS * ROWS * 4]; /* words in columns, as from ls */
+
+/* Count allocations on the way to glibc {{{ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+/* }}} */
+
+static void
+bhost(unused const char *s, unused size_t n)
+{
+}
+
+static void
+bwrite(unused size_t col, unused size_t row, unused wchar_t text[], size_t length, unused color_t fg, unused color_t bg, unused bool bold, unused bool underline)
+{
+    painted.writes += 1;
+    painted.cells += length;
+}
+
+static void
+bclear(unused size_t col, unused size_t row, size_t length, unused color_t bg)
+{
+    painted.clears += 1;
+    painted.cells += length;
+}
+
+static void
+bfinished()
+{
+}
+
+static void
+bscroll(unused size_t top, unused size_t bottom, unused int lines)
+{
+}
+
+static void
+blist(const struct draw_frame_t *frame)
+/* Counted as the calls the runs would have been */
+{
+    size_t i;
+
+    for (i = 0; i < frame->runs; i++) {
+        painted.writes += frame->run[i].text != NULL;
+        painted.clears += frame->run[i].text == NULL;
+        painted.cells  += frame->run[i].cells;
+    }
+}
+
+static int
+perf_open()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t
+perf_read(int fd)
+{
+    uint64_t count = 0;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+static double
+now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *name, void (*run)(), size_t iterations)
+/* Report the fastest of a few rounds, to keep noise from other processes
+ * out of the numbers */
+{
+    const size_t rounds = 5;
+    size_t i, r;
+    int fd = perf_open();
+    uint64_t misses = 0, m;
+    double start, usec, best = 1e12;
+    size_t allocated;
+
+    /* Warm up until a pass allocates nothing, so that one time allocations
+     * aren't counted. This can take more than one pass: an arena that
+     * spilled only grows at the next reset, and the run list doubles as
+     * frames get longer. */
+    for (r = 0; r < 4; r++) {
+        allocated = allocations;
+        run();
+        if (allocations == allocated) {
+            break;
+        }
+    }
+    memset(&painted, 0, sizeof(painted));
+    allocated = allocations;
+
+    for (r = 0; r < rounds; r++) {
+        m = perf_read(fd);
+        start = now();
+
+        for (i = 0; i < iterations; i++) {
+            run();
+        }
+
+        usec = (now() - start) * 1e6 / iterations;
+        if (usec < best) {
+            best = usec;
+            misses = (perf_read(fd) - m) / iterations;
+        }
+    }
+
+    allocated = allocations - allocated;
+
+    printf("%-20s %9.1f us/iter %8lu calls/iter %8lu cells/iter %5lu mallocs",
+           name, best,
+           (unsigned long)((painted.writes + painted.clears) / (iterations * rounds)),
+           (unsigned long)(painted.cells / (iterations * rounds)),
+           (unsigned long)allocated);
+    if (fd >= 0) {
+        printf(" %9lu misses/iter", (unsigned long)misses);
+        close(fd);
+    }
+    printf("\n");
+}
+
+/* Benchmarks {{{ */
+
+static void
+run_write()
+/* Emulate one screen of colorful output */
+{
+    term_write(screen);
+}
+
+static void
+run_redraw()
+/* Full screen repaint, e.g. after expose */
+{
+    term_invalidate();
+    term_flush();
+}
+
+static void
+run_write_flush()
+{
+    term_write(screen);
+    term_flush();
+}
+
+static void
+run_reattach()
+/* Clear and draw the same screen again, as tmux on reattach or a watch
+ * loop does */
+{
+    term_write("\033[H\033[2J");
+    term_write(screen);
+    term_flush();
+}
+
+static void
+run_clear()
+/* Erase the screen with a background color, as full screen programs do */
+{
+    term_write("\033[44m\033[2J\033[m");
+    term_flush();
+}
+
+static void
+run_scattered()
+/* Change a cell at each end of every row, as status lines and meters do */
+{
+    static char buf[ROWS * 32];
+    static size_t iteration;
+    size_t row;
+    char *p = buf;
+
+    iteration++;
+    for (row = 0; row < ROWS; row++) {
+        p += sprintf(p, "\033[%lu;1H%c\033[%lu;%dH%c",
+                     (unsigned long)row + 1, (char)('a' + iteration % 26),
+                     (unsigned long)row + 1, COLS, (char)('a' + iteration % 26));
+    }
+    term_write(buf);
+    term_flush();
+}
+
+static void
+run_gc()
+/* Idle time housekeeping, then a frame */
+{
+    term_gc();
+    term_flush();
+}
+
+static void
+run_panes()
+{
+    term_write(panes);
+}
+
+static void
+run_lines()
+{
+    term_write(lines);
+}
+
+static void
+run_lines_flush()
+/* A few lines scrolled in each frame, as under cat */
+{
+    static size_t offset;
+    char *end = lines + offset, *eol;
+    char save;
+    size_t n;
+
+    for (n = 0; n < 8 && (eol = strchr(end, '\n')) != NULL; n++) {
+        end = eol + 1;
+    }
+    save = *end;
+    *end = '\0';
+    term_write(lines + offset);
+    *end = save;
+    term_flush();
+
+    offset = (*end == '\0') ? 0 : (size_t)(end - lines);
+}
+
+/* }}} */
+
+static void
+make_screen()
+/* A screen full of text, with a new color every few characters */
+{
+    size_t row, col;
+    char *p = screen;
+
+    p += sprintf(p, "\033[H");
+    for (row = 0; row < ROWS; row++) {
+        for (col = 0; col < COLS; col++) {
+            if (col % 7 == 0) {
+                p += sprintf(p, "\033[38;5;%lum", (unsigned long)(row + col) % 256);
+            }
+            *p++ = 'a' + (row * COLS + col) % 26;
+        }
+        if (row < ROWS - 1) {
+            p += sprintf(p, "\r\n");
+        }
+    }
+    *p = '\0';
+}
+
+static void
+make_styled()
+/* A screen where foreground, background and attributes change every few
+ * characters. Mostly exercises run detection in term_flush */
+{
+    size_t row, col;
+    char *p = styled;
+
+    p += sprintf(p, "\033[H");
+    for (row = 0; row < ROWS; row++) {
+        for (col = 0; col < COLS; col++) {
+            if (col % 3 == 0) {
+                p += sprintf(p, "\033[0;%s38;5;%lu;48;5;%lum",
+                             (col / 3) % 2 ? "1;" : "",
+                             (unsigned long)(row + col) % 256,
+                             (unsigned long)(row * col) % 256);
+            }
+            *p++ = 'a' + (row * COLS + col) % 26;
+        }
+        if (row < ROWS - 1) {
+            p += sprintf(p, "\r\n");
+        }
+    }
+    *p = '\0';
+}
+
+static void
+make_sparse()
+/* Rows of file names, some colored, with blanks between them and after */
+{
+    size_t row, col;
+    char *p = sparse;
+
+    p += sprintf(p, "\033[m\033[H\033[2J");
+    for (row = 0; row < ROWS; row++) {
+        for (col = 0; col + 20 <= COLS * 3 / 4; col += 20) {
+            switch ((row + col / 20) % 4) {
+            case 0:
+                p += sprintf(p, "\033[%luGfile%lu.c", (unsigned long)col + 1, (unsigned long)col);
+                break;
+            case 1:
+                p += sprintf(p, "\033[%luG\033[1;34mdirectory\033[m", (unsigned long)col + 1);
+                break;
+            default:
+                p += sprintf(p, "\033[%luGREADME", (unsigned long)col + 1);
+                break;
+            }
+        }
+        if (row < ROWS - 1) {
+            p += sprintf(p, "\r\n");
+        }
+    }
+}
+
+static void
+make_panes()
+/* Each pane scrolls a line, with its own scroll region */
+{
+    size_t i;
+    char *p = panes;
+
+    for (i = 0; i < 16; i++) {
+        p += sprintf(p, "\033[1;%dr\033[%d;1Hleft pane\n", ROWS / 2, ROWS / 2);
+        p += sprintf(p, "\033[%d;%dr\033[%d;1Hright pane\n", ROWS / 2 + 1, ROWS, ROWS);
+    }
+    p += sprintf(p, "\033[r");
+}
+
+static void
+make_lines()
+{
+    size_t i;
+    char *p = lines;
+
+    for (i = 0; i < 2000; i++) {
+        p += sprintf(p, "line %lu\r\n", (unsigned long)i);
+    }
+}
+
+int main()
+{
+    struct term_push_callbacks cb = {
+        .write_host = bhost,
+        .write_screen = bwrite,
+        .write_finished = bfinished,
+        .clear_line = bclear,
+    };
+    util_init();
+    term_init(&cb);
+    term_resize(COLS, ROWS);
+
+    make_screen();
+    term_write(screen);
+    term_flush();
+
+    printf("%dx%d terminal\n", COLS, ROWS);
+    bench("write", run_write, 40);
+    bench("redraw", run_redraw, 40);
+    bench("write+flush", run_write_flush, 40);
+    bench("reattach", run_reattach, 40);
+
+    bench("clear", run_clear, 40);
+
+    term_write(screen);
+    term_flush();
+    bench("scattered", run_scattered, 40);
+    bench("gc+flush", run_gc, 40);
+
+    make_styled();
+    term_write(styled);
+    term_flush();
+    bench("redraw-styled", run_redraw, 40);
+
+    cb.draw_list = blist;
+    bench("redraw-styled-list", run_redraw, 40);
+    cb.draw_list = NULL;
+
+    make_sparse();
+    term_write(sparse);
+    term_flush();
+    bench("redraw-sparse", run_redraw, 40);
+    cb.draw_list = blist;
+    bench("redraw-sparse-list", run_redraw, 40);
+    cb.draw_list = NULL;
+
+    make_panes();
+    bench("scroll-panes", run_panes, 40);
+
+    make_lines();
+    bench("scroll-lines", run_lines, 10);
+    bench("scroll-flush", run_lines_flush, 40);
+    cb.scroll = bscroll;
+    bench("scroll-flush-blit", run_lines_flush, 40);
+    cb.scroll = NULL;
+
+    return 0;
+}
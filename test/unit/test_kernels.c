@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "minunit.h"
+#include "kernels.h"
+#include "util.h"
+
+/* Longer than a row of 64 cells, so every tail length is met */
+#define CELLS 200
+
+static wchar_t text[CELLS], shown_text[CELLS];
+static uint16_t style[CELLS], shown_style[CELLS];
+static uint32_t pixels[CELLS], expect[CELLS];
+static uint8_t mask[CELLS];
+
+static uint64_t
+cells_differ_ref(size_t from, size_t n)
+{
+    uint64_t diff = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (text[from + i] != shown_text[from + i] ||
+            style[from + i] != shown_style[from + i]) {
+            diff |= 1ULL << i;
+        }
+    }
+    return diff;
+}
+
+static size_t
+style_run_ref(size_t from, size_t n)
+{
+    size_t i = 1;
+
+    while (i < n && style[from + i] == style[from]) {
+        i++;
+    }
+    return i;
+}
+
+static bool
+check_fill()
+/* Fill every span of a few lengths and offsets, leaving the rest alone */
+{
+    size_t from, n, i;
+
+    for (from = 0; from < 20; from++) {
+        for (n = 0; from + n < CELLS; n += 7) {
+            memset(text, 0xaa, sizeof(text));
+            memset(style, 0xaa, sizeof(style));
+            kernels.fill_text(text + from, 0x1f600, n);
+            kernels.fill_style(style + from, 0x1234, n);
+            for (i = 0; i < CELLS; i++) {
+                bool in = i >= from && i < from + n;
+                if ((text[i] == 0x1f600) != in || (style[i] == 0x1234) != in) {
+                    return false;
+                }
+            }
+            kernels.fill_text(text + from, '\0', n);
+            kernels.fill_style(style + from, 0, n);
+            for (i = from; i < from + n; i++) {
+                if (text[i] != '\0' || style[i] != 0) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+check_style_run()
+/* Runs ending at each position, from each offset */
+{
+    size_t from, end;
+
+    for (from = 0; from < 20; from++) {
+        for (end = from + 1; end <= CELLS; end++) {
+            memset(style, 0x11, sizeof(style));
+            if (end < CELLS) {
+                style[end] = 0x1112; /* Differs in the low byte only */
+            }
+            if (kernels.style_run(style + from, CELLS - from) != style_run_ref(from, CELLS - from) ||
+                kernels.style_run(style + from, end - from) != end - from) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+check_cells_differ()
+/* A difference in text or style at each cell, and two at once */
+{
+    size_t from, n, i;
+
+    for (from = 0; from < 20; from++) {
+        for (n = 1; n <= 64; n++) {
+            memset(text, 0, sizeof(text));
+            memset(shown_text, 0, sizeof(shown_text));
+            memset(style, 0, sizeof(style));
+            memset(shown_style, 0, sizeof(shown_style));
+            if (kernels.cells_differ(text + from, style + from,
+                                     shown_text + from, shown_style + from, n) != 0) {
+                return false;
+            }
+            for (i = 0; i < n; i++) {
+                text[from + i] = 0x10000; /* Differs in the high half only */
+                style[from + n - 1 - i] = 0x100;
+                if (kernels.cells_differ(text + from, style + from,
+                                         shown_text + from, shown_style + from, n) !=
+                    cells_differ_ref(from, n)) {
+                    return false;
+                }
+                text[from + i] = '\0';
+                style[from + n - 1 - i] = 0;
+            }
+            /* Cells past n are left out */
+            text[from + n] = 'x';
+            if (kernels.cells_differ(text + from, style + from,
+                                     shown_text + from, shown_style + from, n) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+check_pixels()
+/* Spans of a few lengths and offsets, under masks of a few patterns */
+{
+    size_t from, n, i, pattern;
+
+    for (from = 0; from < 20; from++) {
+        for (n = 0; from + n < CELLS; n += 7) {
+            memset(pixels, 0xaa, sizeof(pixels));
+            kernels.fill_pixels(pixels + from, 0x00ff8000, n);
+            for (i = 0; i < CELLS; i++) {
+                if ((pixels[i] == 0x00ff8000) != (i >= from && i < from + n)) {
+                    return false;
+                }
+            }
+            for (pattern = 0; pattern < 4; pattern++) {
+                for (i = 0; i < CELLS; i++) {
+                    /* None, all, every third, and the top bit only */
+                    mask[i] = pattern == 0 ? 0 :
+                              pattern == 1 ? 0xff :
+                              pattern == 2 ? (i % 3 == 0) : 0x80;
+                    pixels[i] = expect[i] = i * 0x01010101u;
+                }
+                for (i = from; i < from + n; i++) {
+                    if (mask[i]) {
+                        expect[i] = 0x00123456;
+                    }
+                }
+                kernels.mask_pixels(pixels + from, mask + from, 0x00123456, n);
+                if (memcmp(pixels, expect, sizeof(pixels)) != 0) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+char *
+test_kernels()
+{
+    const char *name;
+    size_t i;
+
+    /* Each built in that runs here, against the plain loops above */
+    for (i = 0; (name = kernels_list(i)) != NULL; i++) {
+        if (!kernels_select(name)) {
+            printf("    %s: not supported\n", name);
+            continue;
+        }
+        printf("    %s\n", name);
+        mu_assert(strcmp(kernels.name, name) == 0);
+        mu_assert(check_fill());
+        mu_assert(check_style_run());
+        mu_assert(check_cells_differ());
+        mu_assert(check_pixels());
+    }
+    mu_assert(kernels_select("scalar"));
+    mu_assert(!kernels_select("none"));
+    return NULL;
+}
+
+char *
+test_init()
+{
+    const char *best;
+    size_t i;
+
+    /* The first that runs here is picked */
+    for (i = 0; !kernels_select(best = kernels_list(i)); i++);
+    kernels_select("scalar");
+    kernels_init();
+    mu_assert(strcmp(kernels.name, best) == 0);
+    return NULL;
+}
+
+char *
+run_tests()
+{
+    mu_run_test(test_kernels);
+    mu_run_test(test_init);
+    return (char*)NULL;
+}
+
+
+int main()
+{
+    util_init();
+    char *result = run_tests();
+
+    printf("Run %d test(s) with %d check(s)\n", tests_run, tests_checks);
+    if (result != NULL) {
+        printf("FAIL: %s\n", result);
+    }
+    else {
+        printf("OK\n");
+    }
+
+    return result != NULL;
+}
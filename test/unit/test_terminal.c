@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <wchar.h>
 
 #include "minunit.h"
+#include "kernels.h"
 #include "config.h"
 #include "util.h"
 #include "terminal.h"
@@ -20,8 +22,17 @@ static struct {
     color_t *fgs;
     color_t *bgs;
     uint32_t *attrs;
+    size_t   *marks; /* number of combining characters */
     size_t   cols;
     size_t   rows;
+    size_t   painted; /* cells painted or cleared */
+    size_t   calls;   /* calls that painted or cleared */
+    size_t   frames;  /* draw lists passed */
+    size_t   scrolls; /* draw lists that scrolled */
+    size_t   ungrouped; /* runs out of their group in a draw list */
+    size_t   overlaps;  /* runs over cells of another in a draw list */
+    uint64_t keys[64]; /* of rows in the last draw list, see draw_row_t */
+    size_t   listed;   /* rows in the last draw list */
     uint8_t  leds; /* LED bitmap. 0 = off, 1 = on */
 } output;
 
@@ -67,6 +78,8 @@ void
 oclear_cb(size_t col, size_t row, size_t length, color_t bg)
 {
     size_t i;
+    output.painted += length;
+    output.calls ++;
     for (i = 0; i < length; i ++) /* iterate char by char to catch index errors */
     {
         output.text[oindex(col + i, row)] = '\0';
@@ -79,6 +92,8 @@ owrite_cb(size_t col, size_t row, wchar_t text[], size_t length, color_t fg, col
 {
     size_t i;
     size_t index;
+    output.painted += length;
+    output.calls ++;
     for (i = 0; i < length; i ++) /* iterate char by char to catch index errors */
     {
         index = oindex(col + i, row);
@@ -86,6 +101,7 @@ owrite_cb(size_t col, size_t row, wchar_t text[], size_t length, color_t fg, col
         output.fgs[index]  = fg;
         output.bgs[index]  = bg;
         output.attrs[index]  = 0;
+        output.marks[index]  = 0;
         if (bold)
             output.attrs[index] |= OATTR_BOLD;
         if (underline)
@@ -94,6 +110,109 @@ owrite_cb(size_t col, size_t row, wchar_t text[], size_t length, color_t fg, col
     }
 }
 
+void
+owrite_cluster_cb(size_t col, size_t row, wchar_t text[], size_t length, color_t fg, color_t bg, bool bold, bool underline)
+{
+    owrite_cb(col, row, text, 1, fg, bg, bold, underline);
+    output.marks[oindex(col, row)] = length - 1;
+}
+
+void
+oscroll_cb(size_t top, size_t bottom, int lines)
+{
+    size_t n = abs(lines), height = bottom - top + 1, cols = output.cols;
+    size_t from = lines > 0 ? top + n : top;
+    size_t to   = lines > 0 ? top     : top + n;
+    size_t i;
+
+    assert(bottom < output.rows);
+    assert(n < height);
+#define SHIFT(a) memmove(a + to * cols, a + from * cols, (height - n) * cols * sizeof(a[0]))
+    SHIFT(output.text);
+    SHIFT(output.fgs);
+    SHIFT(output.bgs);
+    SHIFT(output.attrs);
+    SHIFT(output.marks);
+#undef SHIFT
+
+    /* Garbage in the uncovered rows, they must be repainted */
+    from = lines > 0 ? bottom - n + 1 : top;
+    for (i = from * cols; i < (from + n) * cols; i++) {
+        output.text[i] = '?';
+    }
+}
+
+static bool
+orun_alike(const struct draw_run_t *a, const struct draw_run_t *b)
+{
+    return (a->text == NULL) == (b->text == NULL) && a->bg == b->bg &&
+           (a->text == NULL || (a->fg == b->fg && a->bold == b->bold &&
+                                a->underline == b->underline));
+}
+
+static void
+odraw_run(const struct draw_run_t *run)
+{
+    if (run->text == NULL || run->wide) {
+        oclear_cb(run->col, run->row, run->cells, run->bg);
+    }
+    if (run->text == NULL) {
+        return;
+    }
+    if (run->cluster) {
+        owrite_cluster_cb(run->col, run->row, run->text, run->length,
+                          run->fg, run->bg, run->bold, run->underline);
+    }
+    else {
+        owrite_cb(run->col, run->row, run->text, run->length,
+                  run->fg, run->bg, run->bold, run->underline);
+    }
+}
+
+void
+odraw_list_cb(const struct draw_frame_t *frame)
+/* Replay frame through the callbacks above, checking how it is grouped */
+{
+    const struct draw_run_t *run = frame->run;
+    size_t i, j;
+
+    output.frames ++;
+    output.listed = frame->rows;
+    for (i = 0; i < frame->rows; i++) {
+        if (frame->row[i].row < LENGTH(output.keys)) {
+            output.keys[frame->row[i].row] = frame->row[i].key;
+        }
+    }
+    if (frame->scroll.lines != 0) {
+        output.scrolls ++;
+        oscroll_cb(frame->scroll.top, frame->scroll.bottom, frame->scroll.lines);
+    }
+    for (i = 0; i < frame->runs; i++) {
+        if (i > 0 && run[i].text == NULL && run[i - 1].text != NULL) {
+            output.ungrouped ++; /* A fill after text */
+        }
+        if (i > 0 && !orun_alike(run + i, run + i - 1)) {
+            for (j = 0; j + 1 < i; j++) {
+                if (orun_alike(run + i, run + j)) {
+                    output.ungrouped ++; /* Back to a group left before */
+                    break;
+                }
+            }
+        }
+        for (j = 0; j < i; j++) {
+            if (run[j].row == run[i].row &&
+                run[j].col < run[i].col + run[i].cells &&
+                run[i].col < run[j].col + run[j].cells) {
+                output.overlaps ++;
+            }
+        }
+        odraw_run(run + i);
+    }
+    if (frame->show_cursor) {
+        odraw_run(&frame->cursor);
+    }
+}
+
 void
 oreschange_cb(size_t cols, size_t rows)
 {
@@ -101,10 +220,21 @@ oreschange_cb(size_t cols, size_t rows)
     output.fgs = realloc(output.fgs, cols * rows * sizeof(output.fgs[0]));
     output.bgs = realloc(output.bgs, cols * rows * sizeof(output.bgs[0]));
     output.attrs = realloc(output.attrs, cols * rows * sizeof(output.attrs[0]));
+    output.marks = realloc(output.marks, cols * rows * sizeof(output.marks[0]));
     output.cols = cols;
     output.rows = rows;
 }
 
+static struct term_push_callbacks callbacks = {
+    .write_host = oresponse,
+    .write_screen = owrite_cb,
+    .write_cluster = owrite_cluster_cb,
+    .write_finished = owrite_finished_cb,
+    .clear_line = oclear_cb,
+    .res_change = oreschange_cb,
+    .scroll = oscroll_cb,
+};
+
 void
 oflush()
 {
@@ -135,6 +265,14 @@ B(size_t col, size_t row)
     return output.bgs[oindex(col, row)];
 }
 
+/* Number of combining characters at position */
+static inline size_t
+M(size_t col, size_t row)
+{
+    oflush();
+    return output.marks[oindex(col, row)];
+}
+
 /* Character attributes at position */
 static inline uint32_t
 A(size_t col, size_t row)
@@ -503,6 +641,129 @@ test_scrollregion()
     mu_assert(O(0,2) == '2');
     mu_assert(O(0,3) == '3');
 
+    /* Below the scroll region, line feeds don't scroll it */
+    oreset();
+    term_write("\033[20l\033[2;3r\033[2;1Hx\033[5;1Ha\nb"); /* No CR with LF */
+    mu_assert(O(0,1) == 'x');
+    mu_assert(O(0,4) == 'a');
+    mu_assert(O(1,5) == 'b');
+    term_write("\033[20h");
+
+    /* Wrapping at the bottom margin keeps the cursor in the region */
+    term_write("\033[3;80Hyz");
+    mu_assert(O(0,1) == '\0');
+    mu_assert(O(79,1) == 'y');
+    mu_assert(O(0,2) == 'z');
+
+    /* Edit lines after the screen has scrolled */
+    oreset();
+    for (char c = 'A'; c < 'A' + 30; c ++) {
+        char line[4] = { c, '\r', '\n', '\0' };
+        term_write(line);
+    }
+    mu_assert(O(0,0)  == 'H');
+    mu_assert(O(0,22) == '^');
+    term_write("\033[1;1H\033[2M"); /* Delete 2 lines */
+    mu_assert(O(0,0)  == 'J');
+    mu_assert(O(0,20) == '^');
+    mu_assert(O(0,21) == '\0');
+    term_write("\033[2;1H\033[1L"); /* Insert a line */
+    mu_assert(O(0,0)  == 'J');
+    mu_assert(O(0,1)  == '\0');
+    mu_assert(O(0,2)  == 'K');
+    mu_assert(O(0,21) == '^');
+
+    return NULL;
+}
+
+char *
+test_scroll()
+{
+    oreset();
+    term_write("1\r\n2\r\n3\r\n4");
+    oflush();
+    output.painted = 0;
+    term_write("\033[2S"); /* Scroll up */
+    mu_assert(O(0,0) == '3');
+    mu_assert(O(0,1) == '4');
+    mu_assert(O(0,2) == '\0');
+    mu_assert(O(0,22) == '\0');
+    mu_assert(O(0,23) == '\0');
+    mu_assert(output.painted <= 2 * 80 + 4); /* New lines and cursor only */
+
+    term_write("\033[3T"); /* Scroll down */
+    mu_assert(O(0,2) == '\0');
+    mu_assert(O(0,3) == '3');
+    mu_assert(O(0,4) == '4');
+
+    /* The cursor doesn't move, and isn't dragged along */
+    mu_assert(B(1,3) == config.foreground);
+    term_write("\033[S");
+    mu_assert(B(1,2) == config.background);
+    mu_assert(B(1,3) == config.foreground);
+
+    /* Within margins */
+    oreset();
+    term_write("1\r\n2\r\n3\r\n4\r\n5");
+    term_write("\033[2;4r\033[S");
+    mu_assert(O(0,0) == '1');
+    mu_assert(O(0,1) == '3');
+    mu_assert(O(0,2) == '4');
+    mu_assert(O(0,3) == '\0');
+    mu_assert(O(0,4) == '5');
+    term_write("\033[2T");
+    mu_assert(O(0,1) == '\0');
+    mu_assert(O(0,2) == '\0');
+    mu_assert(O(0,3) == '3');
+    mu_assert(O(0,4) == '5');
+
+    /* Several regions between flushes */
+    term_write("\033[r\033[S\033[1;2r\033[S\033[r\033[T");
+    mu_assert(O(0,0) == '\0');
+    mu_assert(O(0,1) == '\0');
+    mu_assert(O(0,2) == '\0');
+    mu_assert(O(0,3) == '3');
+    mu_assert(O(0,4) == '5');
+    return NULL;
+}
+
+char *
+test_batched_newlines()
+{
+    /* Scrolling many lines at once gives the same screen as one by one */
+    static char text[8192];
+    static wchar_t expect[80 * 24];
+    char *p = text, *line;
+    size_t i;
+
+    p += sprintf(p, "\033[3;20r");
+    for (i = 0; i < 60; i++) {
+        switch (i % 10) {
+        case 3: p += sprintf(p, "%080lu\r\n", (unsigned long)i); break;
+        case 5: p += sprintf(p, "%0100lu\r\n", (unsigned long)i); break; /* Wraps */
+        case 6: p += sprintf(p, "\xe6\x97\xa5\xe6\x9c\xac %lu\n", (unsigned long)i); break;
+        case 8: p += sprintf(p, "\033[1m%lu\033[0m\n\n", (unsigned long)i); break;
+        case 9: p += sprintf(p, "\t%lu\r\n", (unsigned long)i); break;
+        default: p += sprintf(p, "line %lu\r\n", (unsigned long)i); break;
+        }
+    }
+
+    oreset();
+    term_write(text);
+    oflush();
+    memcpy(expect, output.text, sizeof(expect));
+
+    oreset();
+    for (line = text; *line != '\0'; line = p) {
+        char c;
+        p = strchr(line, '\n') + 1;
+        c = *p;
+        *p = '\0';
+        term_write(line);
+        *p = c;
+        oflush();
+    }
+    mu_assert(memcmp(expect, output.text, sizeof(expect)) == 0);
     return NULL;
 }
 
@@ -525,6 +786,51 @@ test_character_attributes()
     return NULL;
 }
 
+char *
+test_colors()
+{
+    oreset();
+    term_write("123\033[38;5;17m4\033[48;2;1;2;3m5\033[0m");
+    mu_assert(F(3,0) == config.color[17]);
+    mu_assert(B(3,0) == config.background);
+    mu_assert(F(4,0) == config.color[17]);
+    mu_assert(B(4,0) == 0x010203);
+
+    term_write("\033[1;5H\033[48;2;4;5;6m5"); /* Replaces only use of 0x010203 */
+    term_gc();
+    term_invalidate();
+    mu_assert(B(4,0) == 0x040506);
+    return NULL;
+}
+
+char *
+test_styles()
+{
+    size_t i;
+    char buf[64];
+
+    oreset();
+    term_write("\033[1;38;5;1ma\033[0mb\033[1;38;5;1mc\033[4m");
+    for (i = 0; i < 1000; i++) { /* Styles that never reach the screen */
+        sprintf(buf, "\033[38;2;%lu;%lu;0m", (unsigned long)i % 256, (unsigned long)i / 256);
+        term_write(buf);
+    }
+    term_write("\033[0;48;5;2md");
+    term_gc();
+    term_invalidate();
+    mu_assert(F(0,0) == config.color[1]);
+    mu_assert(A(0,0) == OATTR_BOLD);
+    mu_assert(F(1,0) == config.foreground);
+    mu_assert(A(1,0) == 0);
+    mu_assert(F(2,0) == config.color[1]);
+    mu_assert(A(2,0) == OATTR_BOLD);
+    mu_assert(B(3,0) == config.color[2]);
+
+    term_write("e"); /* Current style survives gc */
+    mu_assert(B(4,0) == config.color[2]);
+    return NULL;
+}
+
 char *
 test_wraparound()
 {
@@ -600,6 +906,72 @@ test_editing()
     mu_assert(O(0,12) == '0');
     mu_assert(O(0,13) == '\0');
 
+    /* Lines only move within the scroll region */
+    oreset();
+    term_write("1\n2\n3\n4\n5\n6\n7\n8\n9\n0\n");
+    term_write("\033[3;6r\033[4;1H");
+    oflush();
+    output.painted = 0;
+    term_write("\033[M"); /* Delete a line */
+    mu_assert(O(0,2) == '3');
+    mu_assert(O(0,3) == '5');
+    mu_assert(O(0,4) == '6');
+    mu_assert(O(0,5) == '\0');
+    mu_assert(O(0,6) == '7');
+    mu_assert(output.painted <= 80 + 4); /* The region was shifted */
+    term_write("\033[2L"); /* Insert 2 lines */
+    mu_assert(O(0,2) == '3');
+    mu_assert(O(0,3) == '\0');
+    mu_assert(O(0,4) == '\0');
+    mu_assert(O(0,5) == '5');
+    mu_assert(O(0,6) == '7');
+    term_write("\033[?6l\033[8;1H\033[L"); /* Below the region */
+    mu_assert(O(0,7) == '8');
+
+    return NULL;
+}
+
+char *
+test_write_run()
+{
+    size_t i;
+    char line[201];
+
+    oreset();
+    for (i = 0; i < 200; i++) {
+        line[i] = 'a' + i % 26;
+    }
+    line[200] = '\0';
+    term_write(line); /* Wraps twice */
+    mu_assert(O(0,0)  == 'a');
+    mu_assert(O(79,0) == 'b');
+    mu_assert(O(0,1)  == 'c');
+    mu_assert(O(39,2) == 'r');
+    mu_assert(O(40,2) == '\0');
+
+    oreset();
+    term_write("\033[?7l"); /* No wraparound */
+    term_write(line);
+    mu_assert(O(78,0) == 'a');
+    mu_assert(O(79,0) == 'r'); /* Last character wins */
+    mu_assert(O(0,1)  == '\0');
+    term_write("\033[?7h");
+
+    oreset();
+    term_write("123456\033[1;3H\033[4habc\033[4l"); /* Insert mode */
+    mu_assert(O(1,0) == '2');
+    mu_assert(O(2,0) == 'a');
+    mu_assert(O(4,0) == 'c');
+    mu_assert(O(5,0) == '3');
+    mu_assert(O(8,0) == '6');
+
+    oreset();
+    term_write("\xe6\x97\xa5\xe6\x9c\xac\033[1;2Hxy"); /* Over both glyphs */
+    mu_assert(O(0,0) == ' ');
+    mu_assert(O(1,0) == 'x');
+    mu_assert(O(2,0) == 'y');
+    mu_assert(O(3,0) == ' ');
+
     return NULL;
 }
 
@@ -644,6 +1016,31 @@ test_col_modes()
     return NULL;
 }
 
+char *
+test_resize()
+{
+    oreset();
+    term_write("abcdef\033[24;1Hz\033[12;1Hm");
+
+    /* Shrinking drops what falls outside, growing doesn't bring it back */
+    term_resize(3, 10);
+    mu_assert(O(0,0) == 'a');
+    mu_assert(O(2,0) == 'c');
+    term_resize(80, 24);
+    mu_assert(O(2,0) == 'c');
+    mu_assert(O(3,0) == '\0');
+    mu_assert(O(0,11) == '\0');
+    mu_assert(O(0,23) == '\0');
+
+    /* Beyond the allocated size */
+    term_resize(300, 100);
+    mu_assert(O(2,0) == 'c');
+    mu_assert(O(3,0) == '\0');
+    term_write("\033[100;300Hx");
+    mu_assert(O(299,99) == 'x');
+    return NULL;
+}
+
 char *
 test_tabstops()
 {
@@ -701,6 +1098,460 @@ test_cursor()
     return NULL;
 }
 
+char *
+test_wide()
+{
+    oreset();
+    term_write("a\xe4\xb8\xad" "b"); /* U+4E2D, double width */
+    mu_assert(O(0,0) == 'a');
+    mu_assert(O(1,0) == 0x4e2d);
+    mu_assert(O(2,0) == '\0');
+    mu_assert(O(3,0) == 'b');
+
+    term_write("\033[1;3Hc"); /* Overwrite right half */
+    mu_assert(O(1,0) == ' ');
+    mu_assert(O(2,0) == 'c');
+
+    term_write("\033[1;80H\xe4\xb8\xad"); /* One cell left on the line */
+    mu_assert(O(79,0) == '\0');
+    mu_assert(O(0,1) == 0x4e2d);
+    term_write("d");
+    mu_assert(O(2,1) == 'd');
+
+    term_write("\033[2;2H\033[X"); /* Erase right half */
+    mu_assert(O(0,1) == '\0');
+    mu_assert(O(2,1) == 'd');
+
+    return NULL;
+}
+
+char *
+test_combining()
+{
+    oreset();
+    term_write("e\xcc\x81x"); /* e, combining acute accent */
+    mu_assert(O(0,0) == 'e');
+    mu_assert(M(0,0) == 1);
+    mu_assert(O(1,0) == 'x');
+    mu_assert(M(1,0) == 0);
+
+    term_write("\xcc\x81\xcc\x82"); /* Two more on x */
+    mu_assert(O(1,0) == 'x');
+    mu_assert(M(1,0) == 2);
+    mu_assert(O(2,0) == '\0');
+
+    term_write("\xe4\xb8\xad\xcc\x81"); /* On a double width glyph */
+    mu_assert(O(2,0) == 0x4e2d);
+    mu_assert(M(2,0) == 1);
+
+    term_write("\033[1;1Hf"); /* Overwrite */
+    mu_assert(O(0,0) == 'f');
+    mu_assert(M(0,0) == 0);
+
+    term_write("\033[2;1H\xcc\x81"); /* Nothing to combine with */
+    mu_assert(O(0,1) == '\0');
+
+    term_gc(); /* Renumbers clusters */
+    term_invalidate();
+    mu_assert(O(1,0) == 'x');
+    mu_assert(M(1,0) == 2);
+    mu_assert(O(2,0) == 0x4e2d);
+    mu_assert(M(2,0) == 1);
+
+    return NULL;
+}
+
+char *
+test_alt_screen()
+{
+    oreset();
+    term_write("main\r\nscreen\033[2;3H");
+    oflush();
+    output.painted = 0;
+    term_write("\033[?1049h"); /* Saves cursor, clears */
+    mu_assert(oisempty());
+    mu_assert(output.painted <= 4 + 6 + 4); /* Only the old text is cleared */
+
+    term_write("\033[5;5Halt");
+    mu_assert(O(4,4) == 'a');
+    oflush();
+    output.painted = 0;
+    term_write("\033[?1049l"); /* Back, restores cursor */
+    mu_assert(O(0,0) == 'm');
+    mu_assert(O(0,1) == 's');
+    mu_assert(O(4,4) == '\0');
+    mu_assert(output.painted <= 4 + 6 + 7 + 2); /* Rows up to their last difference, cursor */
+    term_write("X");
+    mu_assert(O(2,1) == 'X');
+
+    /* A cursor saved on the alternate screen is its own */
+    term_write("\033[2;3H\033[?1049h\033[6;7H\0337\033[?1049l");
+    term_write("Y");
+    mu_assert(O(2,1) == 'Y');
+    term_write("\033[?47h\0338Z\033[?47l");
+    term_write("\033[?47h");
+    mu_assert(O(6,5) == 'Z');
+    term_write("\033[?47l");
+
+    /* A cursor saved below the bottom of a smaller screen stays on it */
+    term_write("\033[24;1H\033[?1049h");
+    term_resize(80, 10);
+    term_write("\033[?1049l\033[6n");
+    mu_assert(strcmp(response, "\033[10;1R") == 0);
+    term_write("XYZ");
+    mu_assert(O(0,9) == 'X');
+    mu_assert(O(2,9) == 'Z');
+    term_resize(80, 24);
+
+    /* 1049 starts from a blank screen every time */
+    term_write("\033[?1049h");
+    mu_assert(oisempty());
+    term_write("\033[?1049l");
+
+    /* 47 keeps the alternate screen, 1047 clears it when leaving */
+    term_write("\033[?47h\033[Hone\033[?47l\033[?47h");
+    mu_assert(O(0,0) == 'o');
+    term_write("\033[?1047l\033[?1047h");
+    mu_assert(oisempty());
+    term_write("\033[?1047l");
+    mu_assert(O(0,0) == 'm');
+
+    /* Both screens follow a resize */
+    term_write("\033[?47h\033[1;1Halt");
+    term_resize(40, 10);
+    term_write("\033[?47l");
+    mu_assert(O(0,0) == 'm');
+    term_write("\033[?47h");
+    mu_assert(O(0,0) == 'a');
+
+    /* Cells on the hidden screen survive garbage collection */
+    term_write("\033[38;2;1;2;3m\xe2\x80\x83\xcc\x81\033[m\033[?47l");
+    term_write("\033[3;1H\033[32mgreen\033[m");
+    term_gc();
+    term_write("\033[?47h");
+    mu_assert(O(3,0) == 0x2003);
+    mu_assert(M(3,0) == 1);
+    mu_assert(F(3,0) == 0x010203);
+
+    /* Reset returns to the main screen */
+    term_write("\033c");
+    mu_assert(oisempty());
+    term_write("x\033[?47l");
+    mu_assert(O(0,0) == 'x');
+
+    return NULL;
+}
+
+char *
+test_blank_lines()
+{
+    color_t blue = config.color[4];
+
+    oreset();
+    term_write("\033#8"); /* Fill with E */
+    oflush();
+    output.calls = 0;
+    term_write("\033[44m\033[2J");
+    mu_assert(oisempty());
+    mu_assert(B(1,0) == blue);
+    mu_assert(B(79,23) == blue);
+    mu_assert(output.calls <= 24 + 2); /* A clear per line, and the cursor */
+
+    /* Written lines keep the erased background */
+    term_write("\033[m\033[4;11Hx");
+    mu_assert(O(10,3) == 'x');
+    mu_assert(B(9,3) == blue);
+    mu_assert(B(12,3) == blue);
+
+    /* Part of a blank line */
+    term_write("\033[6;41H\033[K");
+    mu_assert(B(39,5) == blue);
+    mu_assert(B(41,5) == config.background);
+
+    /* Blank lines keep their style through garbage collection and resizes */
+    term_gc();
+    term_invalidate();
+    mu_assert(B(0,0) == blue);
+    term_resize(100, 24);
+    mu_assert(B(0,0) == blue);
+    mu_assert(B(79,0) == blue);
+    mu_assert(B(99,0) == config.background); /* Uncovered, as on any line */
+    mu_assert(O(10,3) == 'x');
+    mu_assert(B(99,3) == config.background);
+    term_resize(200, 24); /* Past the allocated size */
+    mu_assert(B(79,0) == blue);
+    mu_assert(B(80,0) == config.background);
+    mu_assert(B(199,6) == config.background);
+    return NULL;
+}
+
+char *
+test_blink()
+{
+    oreset();
+    term_write("\033[5mab\033[mc");
+    mu_assert(O(0,0) == 'a'); /* Shown first */
+    usleep(700000); /* config.blink_delay */
+    mu_assert(O(0,0) == '\0');
+    mu_assert(O(1,0) == '\0');
+    mu_assert(O(2,0) == 'c');
+
+    /* Once nothing blinks, the next blinking text starts out shown */
+    term_write("\033[2K\r");
+    oflush();
+    term_write("\033[5mab\033[m");
+    mu_assert(O(0,0) == 'a');
+    return NULL;
+}
+
+char *
+test_damage()
+{
+    size_t i;
+
+    oreset();
+    for (i = 0; i < 80; i++) {
+        term_write("-");
+    }
+    oflush();
+    output.painted = 0;
+
+    /* Only the changed cells are repainted, not what is between them */
+    term_write("\033[1;1HA\033[1;80HB");
+    mu_assert(O(0,0) == 'A');
+    mu_assert(O(1,0) == '-');
+    mu_assert(O(79,0) == 'B');
+    mu_assert(output.painted <= 2 + 2); /* And the cursor */
+    return NULL;
+}
+
+char *
+test_front()
+{
+    char *redraw = "\033[H\033[2J\033[1;1Hfirst\033[2;1H\033[44msecond\033[m\033[3;1H";
+
+    oreset();
+    term_write(redraw);
+    oflush();
+    output.painted = 0;
+
+    /* Drawing the same screen again, as tmux does on reattach, only
+     * repaints the cursor */
+    term_write(redraw);
+    mu_assert(O(0,0) == 'f');
+    mu_assert(O(5,1) == 'd');
+    mu_assert(B(5,1) == config.color[4]);
+    mu_assert(output.painted <= 2);
+
+    /* Cells that did change are painted */
+    output.painted = 0;
+    term_write("\033[1;2HI\033[3;1H");
+    mu_assert(O(1,0) == 'I');
+    mu_assert(output.painted <= 1 + 2);
+
+    /* After an invalidate, unchanged cells are painted too */
+    output.painted = 0;
+    term_invalidate();
+    oflush();
+    mu_assert(output.painted >= 80 * 24);
+    return NULL;
+}
+
+static uint64_t (*cells_differ)(const wchar_t *, const uint16_t *,
+                                const wchar_t *, const uint16_t *, size_t);
+static size_t cells_differ_calls;
+
+static uint64_t
+cells_differ_count(const wchar_t *text, const uint16_t *style,
+                   const wchar_t *shown_text, const uint16_t *shown_style, size_t n)
+/* Count the rows compared cell by cell, see test_row_hash */
+{
+    cells_differ_calls++;
+    return cells_differ(text, style, shown_text, shown_style, n);
+}
+
+char *
+test_row_hash()
+{
+    char line[81];
+    size_t i;
+
+    oreset();
+    for (i = 0; i < 80; i++) {
+        line[i] = "ab"[i % 2];
+    }
+    line[80] = '\0';
+    term_write(line); /* One long run */
+    oflush();
+    term_gc(); /* Hashes rows left unhashed */
+    output.painted = 0;
+
+    /* Rewritten in short runs, the rows hash the same */
+    term_write("\033[1;1H");
+    for (i = 0; i < 40; i++) {
+        term_write("a\033[mb");
+    }
+    cells_differ = kernels.cells_differ;
+    kernels.cells_differ = cells_differ_count;
+    cells_differ_calls = 0;
+    mu_assert(O(79,0) == 'b');
+    kernels.cells_differ = cells_differ;
+    mu_assert(cells_differ_calls == 0); /* Not compared cell by cell */
+    mu_assert(output.painted <= 2);
+
+    /* A cell that differs is still caught */
+    term_write("\033[1;40HX");
+    mu_assert(O(39,0) == 'X');
+    mu_assert(O(38,0) == 'a');
+    mu_assert(output.painted <= 2 + 1 + 2);
+    return NULL;
+}
+
+char *
+test_coalesce()
+{
+    oreset();
+    term_write("foo\033[7Gbar\r\n"                     /* Blanks between words */
+               "\033[4mfoo\033[m\r\n"                    /* Underlined */
+               "\033[41mfoo\033[K\033[m\r\n"              /* Erased in color */
+               "\033[32mfoo\033[m\033[31mbar\033[m\r\n");  /* Different colors */
+    oflush();
+    output.calls = 0;
+
+    /* After the invalidate, each row is painted as one run where colors
+     * allow it */
+    term_invalidate();
+    mu_assert(O(0,0) == 'f');
+    mu_assert(O(3,0) == '\0');
+    mu_assert(O(6,0) == 'b');
+    mu_assert(O(79,0) == '\0');
+    mu_assert(A(2,1) == OATTR_UNDERLINE);
+    mu_assert(A(3,1) == 0);
+    mu_assert(B(79,2) == config.color[1]);
+    mu_assert(F(3,3) == config.color[1]);
+    mu_assert(output.calls == 1      /* Row 0, blanks and all */
+                            + 2      /* Row 1, the blanks aren't underlined */
+                            + 1      /* Row 2 */
+                            + 2      /* Row 3, bar and the tail are red */
+                            + 20     /* The rest */
+                            + 1);    /* The cursor, its old cell went with its row */
+    return NULL;
+}
+
+char *
+test_draw_list()
+{
+    static wchar_t text[80 * 24];
+    static color_t fgs[80 * 24], bgs[80 * 24];
+    static uint32_t attrs[80 * 24];
+    static size_t marks[80 * 24];
+    size_t n = 80 * 24;
+
+    oreset();
+    term_write("plain \033[1mbold\033[m \033[31mred\033[44m on blue\033[K\033[m\r\n"
+               "\033[4munder\033[m a\xe4\xb8\xad" "b e\xcc\x81 \033[32mgreen\033[m\r\n"
+               "\033[7mreverse\033[m plain");
+    term_invalidate();
+    oflush();
+    memcpy(text, output.text, sizeof(text));
+    memcpy(fgs, output.fgs, sizeof(fgs));
+    memcpy(bgs, output.bgs, sizeof(bgs));
+    memcpy(attrs, output.attrs, sizeof(attrs));
+    memcpy(marks, output.marks, sizeof(marks));
+
+    /* A draw list paints the same as the calls, in one go, grouped */
+    callbacks.draw_list = odraw_list_cb;
+    output.frames = 0;
+    output.ungrouped = 0;
+    wmemset(output.text, '?', n);
+    term_invalidate();
+    oflush();
+    mu_assert(output.frames == 1);
+    mu_assert(output.ungrouped == 0);
+    mu_assert(memcmp(text, output.text, sizeof(text)) == 0);
+    mu_assert(memcmp(fgs, output.fgs, sizeof(fgs)) == 0);
+    mu_assert(memcmp(bgs, output.bgs, sizeof(bgs)) == 0);
+    mu_assert(memcmp(attrs, output.attrs, sizeof(attrs)) == 0);
+    mu_assert(memcmp(marks, output.marks, sizeof(marks)) == 0);
+
+    /* Scrolls come first in the list */
+    output.scrolls = 0;
+    term_write("\033[24;1H\r\nnext");
+    mu_assert(O(0,0) == 'u');
+    mu_assert(O(0,22) == '\0');
+    mu_assert(O(0,23) == 'n');
+    mu_assert(output.scrolls == 1);
+    mu_assert(output.ungrouped == 0);
+
+    /* The cell the cursor left is painted once, with its row */
+    output.overlaps = 0;
+    term_write("\033[5;1Hab");
+    oflush();
+    term_write("\033[5;3Hc\033[H");
+    mu_assert(O(2,4) == 'c');
+    mu_assert(output.overlaps == 0);
+
+    callbacks.draw_list = NULL;
+    return NULL;
+}
+
+char *
+test_row_keys()
+{
+    uint64_t key;
+
+    oreset();
+    callbacks.draw_list = odraw_list_cb;
+    term_write("\033[1;1Hsame\033[2;1Hother\033[3;1Hsame\033[31mred\033[m");
+    oflush();
+
+    /* Rows are only listed when asked for */
+    mu_assert(output.listed == 0);
+    callbacks.row_keys = true;
+    term_invalidate();
+    oflush();
+    mu_assert(output.listed == 24);
+
+    term_write("\033[3;5H\033[K");
+    oflush();
+
+    /* Rows that look the same have the same key */
+    mu_assert(output.keys[0] == output.keys[2]);
+    mu_assert(output.keys[0] != output.keys[1]);
+
+    /* Reverse video paints them otherwise */
+    key = output.keys[0];
+    term_write("\033[?5h");
+    term_invalidate();
+    oflush();
+    mu_assert(output.keys[0] != key);
+    mu_assert(output.keys[0] == output.keys[2]);
+    term_write("\033[?5l");
+    term_invalidate();
+    oflush();
+    mu_assert(output.keys[0] == key);
+
+    /* After styles are renumbered, ids stand for other styles */
+    term_gc(); /* The red style is no longer used */
+    term_invalidate();
+    oflush();
+    mu_assert(output.keys[0] != key);
+    mu_assert(output.keys[0] == output.keys[2]);
+
+    /* So are they after a reset */
+    term_write("\033c\033[31mhello\033[m");
+    oflush();
+    key = output.keys[0];
+    term_write("\033c\033[32mhello\033[m");
+    oflush();
+    mu_assert(F(0,0) == config.color[2]);
+    mu_assert(output.keys[0] != key);
+
+    callbacks.row_keys = false;
+    callbacks.draw_list = NULL;
+    return NULL;
+}
+
 char *
 run_tests()
 {
@@ -719,23 +1570,33 @@ run_tests()
     mu_run_test(test_editing);
     mu_run_test(test_repeat);
     mu_run_test(test_col_modes);
+    mu_run_test(test_resize);
     mu_run_test(test_style);
+    mu_run_test(test_colors);
+    mu_run_test(test_styles);
+    mu_run_test(test_scroll);
+    mu_run_test(test_batched_newlines);
+    mu_run_test(test_write_run);
+    mu_run_test(test_blank_lines);
+    mu_run_test(test_blink);
+    mu_run_test(test_damage);
+    mu_run_test(test_front);
+    mu_run_test(test_row_hash);
+    mu_run_test(test_coalesce);
+    mu_run_test(test_draw_list);
+    mu_run_test(test_row_keys);
+    mu_run_test(test_alt_screen);
     mu_run_test(test_tabstops);
     mu_run_test(test_cursor);
+    mu_run_test(test_wide);
+    mu_run_test(test_combining);
     return (char*)NULL;
 }
 
 int main()
 {
-    struct term_push_callbacks cb = {
-        .write_host = oresponse,
-        .write_screen = owrite_cb,
-        .write_finished = owrite_finished_cb,
-        .clear_line = oclear_cb,
-        .res_change = oreschange_cb,
-    };
     util_init();
-    term_init(&cb);
+    term_init(&callbacks);
     term_resize(80, 24);
 
     char *result = run_tests();
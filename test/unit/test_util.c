@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "minunit.h"
 #include "util.h"
@@ -46,11 +47,44 @@ test_helpers()
 }
 
 
+char *
+test_arena()
+{
+    struct arena_t arena = {0};
+    char *a, *b;
+
+    /* Empty, so it spills to the heap */
+    a = arena_alloc(&arena, 10);
+    b = arena_alloc(&arena, 100);
+    mu_assert(arena.spill != NULL);
+    mu_assert((uintptr_t)a % 16 == 0);
+    mu_assert((uintptr_t)b % 16 == 0);
+    memset(a, 'a', 10);
+    memset(b, 'b', 100);
+    mu_assert(a[9] == 'a');
+
+    /* Then grows to fit the same again */
+    arena_reset(&arena);
+    mu_assert(arena.spill == NULL);
+    a = arena_alloc(&arena, 10);
+    b = arena_alloc(&arena, 100);
+    mu_assert(arena.spill == NULL);
+    mu_assert(a == arena.base);
+    mu_assert(b == a + 16);
+    mu_assert(b + 100 <= arena.base + arena.size);
+
+    arena_free(&arena);
+    mu_assert(arena.base == NULL);
+    return NULL;
+}
+
+
 char *
 run_tests()
 {
     mu_run_test(test_utf8toucs2);
     mu_run_test(test_helpers);
+    mu_run_test(test_arena);
     return (char*)NULL;
 }
 
@@ -0,0 +1,52 @@
+#include <stdio.h>
+
+#include "minunit.h"
+#include "wcwidth.h"
+
+
+static char *
+test_char_width()
+{
+    mu_assert(char_width('a') == 1);
+    mu_assert(char_width(0x00f6) == 1); /* o with diaeresis */
+    mu_assert(char_width(0x0301) == 0); /* Combining acute accent */
+    mu_assert(char_width(0x200b) == 0); /* Zero width space */
+    mu_assert(char_width(0x4e2d) == 2); /* CJK ideograph */
+    mu_assert(char_width(0xac00) == 2); /* Hangul syllable */
+    mu_assert(char_width(0xff21) == 2); /* Fullwidth A */
+    mu_assert(char_width(0xff61) == 1); /* Halfwidth katakana full stop */
+    mu_assert(char_width(0x1f600) == 2); /* Emoji */
+    mu_assert(char_width(0x2a6d6) == 2); /* Plane 2 ideograph */
+    mu_assert(char_width(0x1bca3) == 0); /* Shorthand format up step */
+    mu_assert(char_width(0x1cc00) == 1); /* Legacy computing supplement */
+    mu_assert(char_width(0x1cf00) == 0); /* Znamenny combining mark */
+    mu_assert(char_width(0x0b50) == 1); /* Unassigned, among Oriya marks */
+    mu_assert(char_width(0x10ffff) == 1);
+    mu_assert(char_width(0x110000) == 1);
+
+    return NULL;
+}
+
+
+char *
+run_tests()
+{
+    mu_run_test(test_char_width);
+    return (char*)NULL;
+}
+
+
+int main()
+{
+    char *result = run_tests();
+
+    printf("Run %d test(s) with %d check(s)\n", tests_run, tests_checks);
+    if (result != NULL) {
+        printf("FAIL: %s\n", result);
+    }
+    else {
+        printf("OK\n");
+    }
+
+    return result != NULL;
+}